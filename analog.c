@@ -0,0 +1,118 @@
+#include "analog.h"
+
+#include "regs.h"
+
+#define OVERSAMPLE_COUNT (1 << (2 * ANALOG_EXTRA_BITS))
+
+typedef struct {
+    uint16_t accumulator;
+    uint8_t samples;
+
+    // Index into analog_axes or bit in analog_buttons.
+    uint8_t output;
+    // ANALOG_AXIS only, (255 << 16) / (high - low) so mapping needs no
+    // division in the interrupt. 8 fractional bits lose several counts
+    // over an 11 bit range.
+    uint32_t scale;
+} AnalogState;
+
+volatile uint8_t analog_axes[ANALOG_AXIS_COUNT];
+volatile uint8_t analog_buttons = 0;
+
+static const AnalogChannel* analog_channels;
+static uint8_t analog_channel_count = 0;
+static AnalogState analog_states[ANALOG_MAX_CHANNELS];
+static uint8_t current_channel = 0;
+
+void select_channel(uint8_t channel) {
+    // AVcc reference, MUX5 is never needed for single ended port F inputs.
+    ADMUX = (1 << REFS0) | (channel & 0b111);
+}
+
+void analog_init(const AnalogChannel* channels, uint8_t count) {
+    analog_channels = channels;
+    analog_channel_count = count;
+
+    uint8_t axes = 0;
+    uint8_t buttons = 0;
+    for (uint8_t i = 0; i < count; i++) {
+	const AnalogChannel* channel = &channels[i];
+	AnalogState* state = &analog_states[i];
+	state->accumulator = 0;
+	state->samples = 0;
+	if (channel->mode == ANALOG_AXIS) {
+	    state->output = axes++;
+	    uint16_t range = channel->high - channel->low;
+	    state->scale = ((255UL << 16) + range / 2) / range;
+	    analog_axes[state->output] = 128;
+	} else {
+	    state->output = buttons++;
+	}
+
+	// The digital input buffer only adds noise and current on an
+	// analog pin.
+	DIDR0 |= (1 << channel->channel);
+    }
+
+    analog_start();
+}
+
+void analog_start() {
+    if (analog_channel_count == 0) {
+	return;
+    }
+
+    // 16 MHz / 128 = 125 kHz, inside the range for full 10 bit accuracy.
+    current_channel = 0;
+    select_channel(analog_channels[0].channel);
+    ADCSRA = (1 << ADEN) | (1 << ADIE) | (1 << ADSC) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
+
+void analog_stop() {
+    ADCSRA = 0;
+}
+
+uint8_t map_axis(const AnalogChannel* channel, const AnalogState* state, uint16_t value) {
+    if (value <= channel->low) {
+	return 0;
+    }
+    if (value >= channel->high) {
+	return 255;
+    }
+
+    uint8_t mapped = ((value - channel->low) * state->scale + 0x8000) >> 16;
+    if (mapped >= 128 - channel->deadzone && mapped <= 128 + channel->deadzone) {
+	return 128;
+    }
+    return mapped;
+}
+
+// Conversions are chained from here instead of free-running, so the mux
+// always matches the result being read even if another interrupt delays
+// this one past the end of the next conversion.
+ISR(ADC_vect) {
+    uint16_t sample = ADC;
+    const AnalogChannel* channel = &analog_channels[current_channel];
+    AnalogState* state = &analog_states[current_channel];
+
+    state->accumulator += sample;
+    if (++state->samples == OVERSAMPLE_COUNT) {
+	uint16_t value = state->accumulator >> ANALOG_EXTRA_BITS;
+	state->accumulator = 0;
+	state->samples = 0;
+
+	if (channel->mode == ANALOG_AXIS) {
+	    analog_axes[state->output] = map_axis(channel, state, value);
+	} else if (value >= channel->high) {
+	    analog_buttons |= (1 << state->output);
+	} else if (value <= channel->low) {
+	    analog_buttons &= ~(1 << state->output);
+	}
+    }
+
+    if (++current_channel == analog_channel_count) {
+	current_channel = 0;
+    }
+    select_channel(analog_channels[current_channel].channel);
+    ADCSRA |= (1 << ADSC);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of report axes fed by ANALOG_AXIS channels. The report descriptor
+// in main.c lists one usage per axis, keep the two in sync.
+#define ANALOG_AXIS_COUNT 3
+
+#define ANALOG_MAX_CHANNELS 6
+
+// Each reading averages 4^ANALOG_EXTRA_BITS conversions, which buys that
+// many bits on top of the ADC's 10.
+#define ANALOG_EXTRA_BITS 1
+#define ANALOG_MAX_VALUE ((1 << (10 + ANALOG_EXTRA_BITS)) - 1)
+
+typedef enum {
+    // Mapped onto 0-255 and reported as the next axis.
+    ANALOG_AXIS,
+    // Treated as a button that's pressed past a threshold.
+    ANALOG_DIGITAL,
+} analog_mode_t;
+
+typedef struct {
+    uint8_t channel;  // ADC mux channel, see ADC_CHANNEL in hal.h
+    analog_mode_t mode;
+
+    // ANALOG_AXIS: the raw range that maps onto 0-255.
+    // ANALOG_DIGITAL: released at or below low, pressed at or above high.
+    uint16_t low;
+    uint16_t high;
+
+    // ANALOG_AXIS: how far from 128 still reads as centered. 0 for sliders.
+    uint8_t deadzone;
+} AnalogChannel;
+
+// Written from the ADC interrupt as readings complete.
+extern volatile uint8_t analog_axes[ANALOG_AXIS_COUNT];
+// Bit i is set while the i-th ANALOG_DIGITAL channel is pressed.
+extern volatile uint8_t analog_buttons;
+
+// Starts converting the channels round-robin in the background. channels
+// must outlive the subsystem.
+void analog_init(const AnalogChannel* channels, uint8_t count);
+
+// The ADC has to be off in power-down to meet the suspend current budget.
+void analog_stop();
+void analog_start();
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "regs.h"
+
+// Timer1 free-running at F_CPU / 64, one tick every 4 us. It wraps every
+// 262 ms, so only ever compare differences between two readings.
+#define TICK_US 4
+
+static inline void clock_init() {
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11) | (1 << CS10);
+}
+
+static inline uint16_t clock_ticks() {
+    return TCNT1;
+}
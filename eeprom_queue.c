@@ -0,0 +1,53 @@
+#include "eeprom_queue.h"
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+_Static_assert((EEPROM_QUEUE_LENGTH & (EEPROM_QUEUE_LENGTH - 1)) == 0, "EEPROM queue length isn't a power of two");
+
+typedef struct {
+    uint16_t address;
+    uint8_t data;
+} EepromWrite;
+
+// Only the main loop touches the queue, so it needs no locking.
+static EepromWrite queue[EEPROM_QUEUE_LENGTH];
+static uint8_t head = 0;
+static uint8_t tail = 0;
+
+int eeprom_queue_write(uint16_t address, const uint8_t* data, uint8_t length) {
+    uint8_t used = (uint8_t)(tail - head) & (EEPROM_QUEUE_LENGTH - 1);
+    if (length > EEPROM_QUEUE_LENGTH - 1 - used) {
+	return -1;
+    }
+    for (uint8_t i = 0; i < length; i++) {
+	queue[tail] = (EepromWrite){address + i, data[i]};
+	tail = (tail + 1) & (EEPROM_QUEUE_LENGTH - 1);
+    }
+    return 0;
+}
+
+bool eeprom_queue_idle() {
+    return head == tail && !(EECR & (1 << EEPE));
+}
+
+void eeprom_queue_task() {
+    if (head == tail || (EECR & (1 << EEPE))) {
+	return;
+    }
+    EepromWrite* write = &queue[head];
+    head = (head + 1) & (EEPROM_QUEUE_LENGTH - 1);
+
+    EEAR = write->address;
+    EECR |= (1 << EERE);
+    if (EEDR == write->data) {
+	return;
+    }
+    EEDR = write->data;
+
+    // EEPE has to be set within four cycles of EEMPE.
+    cli();
+    EECR = (1 << EEMPE);  // Erase and write in one go
+    EECR |= (1 << EEPE);
+    sei();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// EEPROM writes take 3.4 ms a byte, far too long to wait on in the main
+// loop. Writes are queued here instead and written out a byte at a time by
+// eeprom_queue_task, which only ever starts a write when the last one has
+// finished. Bytes that already hold the value are skipped, to spare the
+// cells.
+#define EEPROM_QUEUE_LENGTH 32
+
+// Queues length bytes to be written from address on. Returns -1 and queues
+// nothing when there isn't room for all of them.
+int eeprom_queue_write(uint16_t address, const uint8_t* data, uint8_t length);
+
+// Whether everything queued has been written.
+bool eeprom_queue_idle();
+
+// Background task, starts the next queued write if the EEPROM is free.
+void eeprom_queue_task();
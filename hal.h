@@ -1,8 +1,17 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "regs.h"
+
+// The matrix scan waits for rows to settle. Whoever includes this defines
+// F_CPU first, like for any other user of the delay loops.
+#ifndef HOST
+#include <util/delay.h>
+#endif
+
 // Pin format, bits:
 //   abcd_efgh
 //
@@ -40,10 +49,42 @@ typedef uint8_t pin_t;
 #define PIN_D14 0b000011
 #define PIN_D15 0b000001
 #define PIN_A0 0b100111
-#define PIN_A1 0b100011
+#define PIN_A1 0b100110
 #define PIN_A2 0b100101
 #define PIN_A3 0b100100
 
+// The RX and TX LEDs, PB0 and PD5.
+#define PIN_RXLED 0b000000
+#define PIN_TXLED 0b010101
+
+// Compile-time versions of the functions below, for a constant pin. The
+// port choice folds away, leaving a single register access.
+#define PIN_PORT(pin) (((pin) >> 3) & 0b111)
+#define PIN_MASK(pin) (1 << ((pin) & 0b111))
+#define PORT_REGISTER(pin, b, c, d, e, f) (*( \
+    PIN_PORT(pin) == 0 ? &(b) : \
+    PIN_PORT(pin) == 1 ? &(c) : \
+    PIN_PORT(pin) == 2 ? &(d) : \
+    PIN_PORT(pin) == 3 ? &(e) : &(f)))
+#define PIN_INPUT(pin) PORT_REGISTER(pin, PINB, PINC, PIND, PINE, PINF)
+#define PIN_DIRECTION(pin) PORT_REGISTER(pin, DDRB, DDRC, DDRD, DDRE, DDRF)
+#define PIN_OUTPUT(pin) PORT_REGISTER(pin, PORTB, PORTC, PORTD, PORTE, PORTF)
+#define PIN_IS_LOW(pin) ((PIN_INPUT(pin) & PIN_MASK(pin)) == 0)
+#define PIN_PULL_UP(pin) do { \
+    PIN_DIRECTION(pin) &= ~PIN_MASK(pin); \
+    PIN_OUTPUT(pin) |= PIN_MASK(pin); \
+} while (0)
+
+// For build time checks on layouts. The pins each port has on the
+// ATmega32u4, less port C, which the USB code drives as outputs. PIN_BIT
+// gives every pin_t a bit of its own, to find two uses of one pin.
+#define PORT_PINS(port) ((port) == 0 ? 0xFF : (port) == 2 ? 0xFF : (port) == 3 ? 0x44 : (port) == 4 ? 0xF3 : 0)
+#define PIN_EXISTS(pin) ((pin) >= 0 && (pin) <= 0b111111 && (PORT_PINS(PIN_PORT(pin)) & PIN_MASK(pin)) != 0)
+#define PIN_BIT(pin) (1ULL << ((pin) & 0b111111))
+
+// ADC mux channel of a port F pin, PF0-PF7 are ADC0-ADC7.
+#define ADC_CHANNEL(pin) ((pin) & 0b111)
+
 // TODO: how to make these functions not cost so many cycles?
 void set_pull_up(pin_t pin) {
     uint8_t port = ((pin & 0b111000) >> 3) & 0b111;
@@ -61,20 +102,169 @@ void set_pull_up(pin_t pin) {
     } else if (port == 0b011) {
 	DDRE &= ~(1 << raw_pin);
 	PORTE |= (1 << raw_pin);
+    } else if (port == 0b100) {
+	DDRF &= ~(1 << raw_pin);
+	PORTF |= (1 << raw_pin);
     }
 }
 
-bool is_pin_low(pin_t pin) {
+volatile uint8_t* pin_register(pin_t pin) {
+    uint8_t port = ((pin & 0b111000) >> 3) & 0b111;
+    if (port == 0b000) {
+	return &PINB;
+    } else if (port == 0b001) {
+	return &PINC;
+    } else if (port == 0b010) {
+	return &PIND;
+    } else if (port == 0b011) {
+	return &PINE;
+    }
+    return &PINF;
+}
+
+volatile uint8_t* ddr_register(pin_t pin) {
     uint8_t port = ((pin & 0b111000) >> 3) & 0b111;
-    uint8_t raw_pin = pin & 0b111;
     if (port == 0b000) {
-	return (PINB & (1 << raw_pin)) == 0;
+	return &DDRB;
     } else if (port == 0b001) {
-	return (PINC & (1 << raw_pin)) == 0;
+	return &DDRC;
     } else if (port == 0b010) {
-	return (PIND & (1 << raw_pin)) == 0;
+	return &DDRD;
     } else if (port == 0b011) {
-	return (PINE & (1 << raw_pin)) == 0;
+	return &DDRE;
+    }
+    return &DDRF;
+}
+
+volatile uint8_t* port_register(pin_t pin) {
+    uint8_t port = ((pin & 0b111000) >> 3) & 0b111;
+    if (port == 0b000) {
+	return &PORTB;
+    } else if (port == 0b001) {
+	return &PORTC;
+    } else if (port == 0b010) {
+	return &PORTD;
+    } else if (port == 0b011) {
+	return &PORTE;
+    }
+    return &PORTF;
+}
+
+// Only some pins can wake the MCU out of power-down: all of port B
+// (PCINT0-7), PD0-PD3 (INT0-3) and PE6 (INT6). Other pins are ignored.
+//
+// The INTn pins are armed as low level interrupts, since edge detection on
+// INT6 needs the I/O clock that power-down stops.
+void enable_wake_on_pin(pin_t pin) {
+    uint8_t port = ((pin & 0b111000) >> 3) & 0b111;
+    uint8_t raw_pin = pin & 0b111;
+
+    if (port == 0b000) {
+	PCMSK0 |= (1 << raw_pin);
+	PCIFR = (1 << PCIF0);
+	PCICR |= (1 << PCIE0);
+    } else if (port == 0b010 && raw_pin < 4) {
+	EICRA &= ~(0b11 << (2 * raw_pin));
+	EIFR = (1 << raw_pin);
+	EIMSK |= (1 << raw_pin);
+    } else if (port == 0b011 && raw_pin == 6) {
+	EICRB &= ~(0b11 << ISC60);
+	EIFR = (1 << INTF6);
+	EIMSK |= (1 << INT6);
+    }
+}
+
+void disable_wake_on_pins() {
+    PCICR = 0;
+    PCMSK0 = 0;
+    EIMSK = 0;
+}
+
+// Waking up is all these are for. Level interrupts keep firing while the
+// button is held, so disarm everything on the first one.
+ISR(PCINT0_vect) {
+    disable_wake_on_pins();
+}
+ISR(INT0_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(INT1_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(INT2_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(INT3_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(INT6_vect, ISR_ALIASOF(PCINT0_vect));
+
+// Diode matrix scanning, for more buttons than there are free pins. Each
+// row is driven low in turn and the columns are read back as one port read,
+// so they have to be consecutive pins on the same port. With a diode per
+// switch (cathode towards the row) there is no ghosting.
+//
+// Button row * column_count + column of the packed word is the switch at
+// (row, column), so the result slots in wherever a direct scan did.
+#define MATRIX_MAX_ROWS 8
+
+// How long a driven row gets to pull the columns down before they're read.
+#define MATRIX_SETTLE_US 0.5
+
+typedef struct {
+    const pin_t* rows;
+    uint8_t row_count;
+    pin_t first_column;
+    uint8_t column_count;
+} Matrix;
+
+static volatile uint8_t* matrix_row_ddrs[MATRIX_MAX_ROWS];
+static uint8_t matrix_row_masks[MATRIX_MAX_ROWS];
+static uint8_t matrix_row_count = 0;
+
+static volatile uint8_t* matrix_columns;
+static uint8_t matrix_column_shift;
+static uint8_t matrix_column_mask;
+static uint8_t matrix_column_count;
+
+void matrix_init(const Matrix* matrix) {
+    matrix_row_count = matrix->row_count;
+    for (uint8_t i = 0; i < matrix->row_count; i++) {
+	pin_t row = matrix->rows[i];
+	matrix_row_ddrs[i] = ddr_register(row);
+	matrix_row_masks[i] = 1 << (row & 0b111);
+
+	// Rows idle as floating inputs and are only ever driven low.
+	*ddr_register(row) &= ~matrix_row_masks[i];
+	*port_register(row) &= ~matrix_row_masks[i];
+    }
+
+    matrix_columns = pin_register(matrix->first_column);
+    matrix_column_shift = matrix->first_column & 0b111;
+    matrix_column_mask = (1 << matrix->column_count) - 1;
+    matrix_column_count = matrix->column_count;
+    for (uint8_t i = 0; i < matrix->column_count; i++) {
+	set_pull_up(matrix->first_column + i);
+    }
+}
+
+uint16_t matrix_scan() {
+    uint16_t pressed = 0;
+    uint8_t shift = 0;
+    for (uint8_t row = 0; row < matrix_row_count; row++) {
+	*matrix_row_ddrs[row] |= matrix_row_masks[row];
+	_delay_us(MATRIX_SETTLE_US);
+	uint8_t columns = ~*matrix_columns >> matrix_column_shift;
+	*matrix_row_ddrs[row] &= ~matrix_row_masks[row];
+
+	pressed |= (uint16_t)(columns & matrix_column_mask) << shift;
+	shift += matrix_column_count;
+    }
+    return pressed;
+}
+
+// For sleeping: with every row driven low, any press pulls its column low
+// and the columns can act as wake pins.
+void matrix_drive_all_rows() {
+    for (uint8_t row = 0; row < matrix_row_count; row++) {
+	*matrix_row_ddrs[row] |= matrix_row_masks[row];
+    }
+}
+
+void matrix_release_all_rows() {
+    for (uint8_t row = 0; row < matrix_row_count; row++) {
+	*matrix_row_ddrs[row] &= ~matrix_row_masks[row];
     }
-    return false;
 }
@@ -0,0 +1,93 @@
+#include "health.h"
+
+#include <string.h>
+
+#include "clock.h"
+
+#define NO_PRESS_YET 0xFFFF
+
+static uint16_t previous_raw = 0;
+static uint16_t previous_debounced = 0;
+
+// clock_ticks() wraps every 262 ms, far too soon to time a stuck button,
+// so keep a wider running count of ticks.
+static uint16_t last_now = 0;
+static uint32_t elapsed = 0;
+
+static uint16_t presses[MAX_BUTTONS];
+static uint16_t bounces[MAX_BUTTONS];
+static uint32_t shortest_press[MAX_BUTTONS];
+static uint32_t pressed_at[MAX_BUTTONS];
+
+void health_init() {
+    previous_raw = 0;
+    previous_debounced = 0;
+    memset(presses, 0, sizeof(presses));
+    memset(bounces, 0, sizeof(bounces));
+    for (uint8_t i = 0; i < MAX_BUTTONS; i++) {
+	shortest_press[i] = UINT32_MAX;
+    }
+}
+
+void health_update(uint16_t raw, uint16_t debounced, uint16_t now) {
+    uint16_t edges = debounced ^ previous_debounced;
+    uint16_t bounced = (raw ^ previous_raw) & ~edges;
+
+    // The report is read from the USB interrupt, which mustn't see a
+    // counter half written.
+    cli();
+    elapsed += (uint16_t)(now - last_now);
+    last_now = now;
+    previous_raw = raw;
+    previous_debounced = debounced;
+
+    uint16_t bit = 1;
+    for (uint8_t i = 0; (edges | bounced) >= bit && i < MAX_BUTTONS; i++, bit <<= 1) {
+	if ((bounced & bit) && bounces[i] != UINT16_MAX) {
+	    bounces[i]++;
+	}
+	if ((edges & bit) == 0) {
+	    continue;
+	}
+
+	if (debounced & bit) {
+	    if (presses[i] != UINT16_MAX) {
+		presses[i]++;
+	    }
+	    pressed_at[i] = elapsed;
+	} else if (elapsed - pressed_at[i] < shortest_press[i]) {
+	    shortest_press[i] = elapsed - pressed_at[i];
+	}
+    }
+    sei();
+}
+
+uint16_t ticks_to_ms(uint32_t ticks) {
+    uint32_t ms = ticks / (1000 / TICK_US);
+    return ms < UINT16_MAX ? ms : UINT16_MAX;
+}
+
+void write_word(uint8_t* report, uint16_t word) {
+    report[0] = word;
+    report[1] = word >> 8;
+}
+
+void build_entry(uint8_t i, uint8_t* entry) {
+    write_word(entry, presses[i]);
+    write_word(entry + 2, bounces[i]);
+    write_word(entry + 4, shortest_press[i] == UINT32_MAX ? NO_PRESS_YET : ticks_to_ms(shortest_press[i]));
+    write_word(entry + 6, (previous_debounced >> i) & 1 ? ticks_to_ms(elapsed - pressed_at[i]) : 0);
+}
+
+void health_read_report(uint8_t offset, uint8_t* chunk, uint8_t length) {
+    uint8_t entry[HEALTH_ENTRY_SIZE];
+    uint8_t built = MAX_BUTTONS;
+    for (uint8_t i = 0; i < length; i++, offset++) {
+	uint8_t button = offset / HEALTH_ENTRY_SIZE;
+	if (button != built) {
+	    build_entry(button, entry);
+	    built = button;
+	}
+	chunk[i] = entry[offset % HEALTH_ENTRY_SIZE];
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "report.h"
+#include "usb.h"
+
+// Per-button wear statistics, for spotting a failing switch before it
+// fails mid-match. Exported as the vendor interface's VENDOR_REPORT_ID_HEALTH
+// feature report, one HEALTH_ENTRY_SIZE entry per button of little endian
+// words:
+//
+//   presses        debounced presses, saturating
+//   bounces        raw edges the debounce swallowed, saturating
+//   shortest press in ms, 0xFFFF until the first release
+//   held for       in ms, 0 when released, saturating. Stuck switches
+//                  show up here.
+#define HEALTH_ENTRY_SIZE 8
+#define HEALTH_REPORT_SIZE (MAX_BUTTONS * HEALTH_ENTRY_SIZE)
+
+_Static_assert(1 + HEALTH_REPORT_SIZE <= VENDOR_FEATURE_REPORT_MAX_SIZE, "Health report doesn't fit a vendor feature report");
+
+void health_init();
+
+// Called with every scan, before and after debouncing. Costs a few
+// word-wide operations unless something changed.
+void health_update(uint16_t raw, uint16_t debounced, uint16_t now);
+
+// Fills in length bytes of the report from offset on. Called from the USB
+// interrupt, which health_update never lets in halfway through an update.
+void health_read_report(uint8_t offset, uint8_t* chunk, uint8_t length);
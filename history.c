@@ -0,0 +1,97 @@
+#include "history.h"
+
+#include "clock.h"
+
+typedef struct {
+    uint16_t delta;
+    uint16_t buttons;
+} HistoryEntry;
+
+static HistoryEntry entries[HISTORY_LENGTH];
+static uint8_t next = 0;
+static uint8_t count = 0;
+static bool frozen = false;
+
+static uint16_t freeze_chord = 0;
+static uint16_t previous = 0;
+
+// Ticks since the last entry. clock_ticks() wraps every 262 ms, well short
+// of what a delta can hold.
+static uint16_t last_now = 0;
+static uint32_t since_entry = 0;
+
+void history_init(uint16_t chord) {
+    freeze_chord = chord;
+    next = 0;
+    count = 0;
+    frozen = false;
+    previous = 0;
+}
+
+void history_record(uint16_t buttons, uint16_t now) {
+    since_entry += (uint16_t)(now - last_now);
+    last_now = now;
+    if (buttons == previous) {
+	return;
+    }
+
+    if ((buttons & freeze_chord) == freeze_chord && (previous & freeze_chord) != freeze_chord) {
+	frozen = !frozen;
+    }
+    previous = buttons;
+    if (frozen) {
+	return;
+    }
+
+    uint32_t delta = since_entry / HISTORY_TICKS_PER_UNIT;
+    since_entry %= HISTORY_TICKS_PER_UNIT;  // Keep the remainder so deltas don't drift
+
+    // The entry and the ring position change together as far as the USB
+    // interrupt is concerned.
+    cli();
+    entries[next].delta = delta < UINT16_MAX ? delta : UINT16_MAX;
+    entries[next].buttons = buttons;
+    next = next + 1 == HISTORY_LENGTH ? 0 : next + 1;
+    if (count < HISTORY_LENGTH) {
+	count++;
+    }
+    sei();
+}
+
+uint8_t read_byte(uint8_t offset) {
+    switch (offset) {
+    case 0:
+	return count;
+    case 1:
+	return frozen ? HISTORY_FROZEN : 0;
+    case 2:
+	return (HISTORY_TICKS_PER_UNIT * TICK_US) & 0xFF;
+    case 3:
+	return (HISTORY_TICKS_PER_UNIT * TICK_US) >> 8;
+    }
+
+    uint8_t i = (offset - HISTORY_HEADER_SIZE) / HISTORY_ENTRY_SIZE;
+    if (i >= count) {
+	return 0;
+    }
+    // Oldest first.
+    uint8_t index = next >= count ? next - count : next + HISTORY_LENGTH - count;
+    index = index + i < HISTORY_LENGTH ? index + i : index + i - HISTORY_LENGTH;
+    switch ((offset - HISTORY_HEADER_SIZE) % HISTORY_ENTRY_SIZE) {
+    case 0:
+	return entries[index].delta;
+    case 1:
+	return entries[index].delta >> 8;
+    case 2:
+	return entries[index].buttons;
+    }
+    return entries[index].buttons >> 8;
+}
+
+void history_read_report(uint8_t offset, uint8_t* chunk, uint8_t length) {
+    // The whole transfer happens inside the USB interrupt, so the main loop
+    // can't move entries along between packets.
+    for (uint8_t i = 0; i < length; i++) {
+	chunk[i] = read_byte(offset + i);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb.h"
+
+// Rolling record of the last HISTORY_LENGTH changes to the debounced button
+// word, for working out afterwards what was actually pressed and when.
+// Holding the freeze chord stops recording so the moment in question can't
+// scroll out, and holding it again resumes.
+//
+// Exported as the VENDOR_REPORT_ID_HISTORY feature report, which
+// simulator.c can replay:
+//
+//   count          entries that follow, oldest first
+//   flags          bit 0 set while frozen
+//   unit           of the deltas, in us, little endian word
+//   entries        count times:
+//     delta        since the previous entry in units, little endian word,
+//                  saturating. Meaningless for the oldest entry.
+//     buttons      the whole button word from then on, little endian
+#define HISTORY_LENGTH 60
+#define HISTORY_HEADER_SIZE 4
+#define HISTORY_ENTRY_SIZE 4
+#define HISTORY_REPORT_SIZE (HISTORY_HEADER_SIZE + HISTORY_LENGTH * HISTORY_ENTRY_SIZE)
+
+_Static_assert(1 + HISTORY_REPORT_SIZE <= VENDOR_FEATURE_REPORT_MAX_SIZE, "History doesn't fit a vendor feature report");
+
+// 64 us per unit, so a delta covers up to 4 seconds.
+#define HISTORY_TICKS_PER_UNIT 16
+
+#define HISTORY_FROZEN 0x01
+
+void history_init(uint16_t freeze_chord);
+
+// Called with every debounced scan. Unless the buttons changed, that's just
+// keeping time.
+void history_record(uint16_t buttons, uint16_t now);
+
+// Fills in length bytes of the report from offset on. Called from the USB
+// interrupt, which history_record never lets in halfway through adding an
+// entry.
+void history_read_report(uint8_t offset, uint8_t* chunk, uint8_t length);
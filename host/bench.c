@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../health.h"
+#include "../input.h"
+#include "../layout.h"
+#include "../report.h"
+#include "mock_regs.h"
+
+// Microbenchmarks for the input path, run natively against the mock
+// registers. Numbers are host nanoseconds, only good for comparing two
+// versions of the same stage, not for predicting AVR cycles.
+
+#define ITERATIONS 10000000
+#define PATTERN_COUNT 256
+
+// A pseudo random press pattern per port, biased towards few buttons held
+// so the stages see both quiet and busy scans.
+static uint8_t port_b_patterns[PATTERN_COUNT];
+static uint8_t port_d_patterns[PATTERN_COUNT];
+static uint8_t port_e_patterns[PATTERN_COUNT];
+static uint16_t word_patterns[PATTERN_COUNT];
+
+static volatile uint16_t sink;
+
+double now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+void make_patterns() {
+    srand(1);
+    for (int i = 0; i < PATTERN_COUNT; i++) {
+	// Pins read low when pressed.
+	port_b_patterns[i] = ~(rand() & rand() & rand());
+	port_d_patterns[i] = ~(rand() & rand() & rand());
+	port_e_patterns[i] = ~(rand() & rand() & rand());
+	word_patterns[i] = rand() & rand() & rand();
+    }
+}
+
+void report(const char* name, double start) {
+    printf("%-16s %6.2f ns/iteration\n", name, (now_ns() - start) / ITERATIONS);
+}
+
+void bench_scan() {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	PINB = port_b_patterns[i % PATTERN_COUNT];
+	PIND = port_d_patterns[i % PATTERN_COUNT];
+	PINE = port_e_patterns[i % PATTERN_COUNT];
+	sink = scan_buttons();
+    }
+    report("scan", start);
+}
+
+void bench_debounce() {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	sink = debounce(word_patterns[i % PATTERN_COUNT], i);
+    }
+    report("debounce", start);
+}
+
+void bench_socd() {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	sink = socd_clean(word_patterns[i % PATTERN_COUNT]);
+    }
+    report("socd", start);
+}
+
+void bench_health() {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	// Debounce swallows most edges, so feed it a slower copy as the
+	// debounced word.
+	health_update(word_patterns[i % PATTERN_COUNT], word_patterns[(i / 16) % PATTERN_COUNT], i);
+    }
+    report("health", start);
+}
+
+void bench_coalesce() {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	sink = coalesce(word_patterns[i % PATTERN_COUNT], i, i - i % FRAME_TICKS);
+    }
+    report("coalesce", start);
+}
+
+void bench_builder(const char* name, report_builder_t builder) {
+    uint8_t buffer[KEYBOARD_REPORT_SIZE];
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	sink = builder(buffer, word_patterns[i % PATTERN_COUNT]);
+    }
+    report(name, start);
+}
+
+void bench_pipeline() {
+    uint8_t buffer[KEYBOARD_REPORT_SIZE];
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+	PINB = port_b_patterns[i % PATTERN_COUNT];
+	PIND = port_d_patterns[i % PATTERN_COUNT];
+	PINE = port_e_patterns[i % PATTERN_COUNT];
+	TCNT1 = i;
+	uint16_t pressed = input_process(scan_buttons(), clock_ticks(), 0);
+	sink = REPORT_BUILDERS[1](buffer, pressed);
+    }
+    report("pipeline", start);
+}
+
+int main(int argc, char** argv) {
+    make_patterns();
+    layout_init();
+
+    bench_scan();
+    bench_debounce();
+    bench_socd();
+    bench_health();
+    bench_coalesce();
+    bench_builder("boot report", build_boot_report);
+    bench_builder("nkro report", build_nkro_report);
+    bench_pipeline();
+    return 0;
+}
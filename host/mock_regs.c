@@ -0,0 +1,16 @@
+#include "mock_regs.h"
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t PINC, DDRC, PORTC;
+volatile uint8_t PIND, DDRD, PORTD;
+volatile uint8_t PINE, DDRE, PORTE;
+volatile uint8_t PINF, DDRF, PORTF;
+
+volatile uint8_t PCICR, PCIFR, PCMSK0;
+volatile uint8_t EICRA, EICRB, EIMSK, EIFR;
+
+volatile uint8_t ADMUX, ADCSRA, DIDR0;
+volatile uint16_t ADC;
+
+volatile uint8_t TCCR1A, TCCR1B;
+volatile uint16_t TCNT1;
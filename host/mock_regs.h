@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// Stand-ins for the ATmega32u4 registers the input path touches. Bit
+// numbers match the datasheet so the sources compile unchanged.
+extern volatile uint8_t PINB, DDRB, PORTB;
+extern volatile uint8_t PINC, DDRC, PORTC;
+extern volatile uint8_t PIND, DDRD, PORTD;
+extern volatile uint8_t PINE, DDRE, PORTE;
+extern volatile uint8_t PINF, DDRF, PORTF;
+
+extern volatile uint8_t PCICR, PCIFR, PCMSK0;
+extern volatile uint8_t EICRA, EICRB, EIMSK, EIFR;
+
+extern volatile uint8_t ADMUX, ADCSRA, DIDR0;
+extern volatile uint16_t ADC;
+
+extern volatile uint8_t TCCR1A, TCCR1B;
+extern volatile uint16_t TCNT1;
+
+#define PCIE0 0
+#define PCIF0 0
+#define ISC60 4
+#define INT6 6
+#define INTF6 6
+
+#define REFS0 6
+#define ADEN 7
+#define ADSC 6
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define CS11 1
+#define CS10 0
+
+// Interrupts are never raised natively, ISRs are just functions that the
+// benchmarks can call.
+#define ISR(vector, ...) void vector(void)
+#define cli()
+#define sei()
+
+// Natively there's only the one address space.
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+
+#define _delay_us(us)
+#define _delay_ms(ms)
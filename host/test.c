@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../analog.h"
+#include "../health.h"
+#include "../history.h"
+#include "../input.h"
+#include "../keys.h"
+#include "../report.h"
+#include "mock_regs.h"
+
+// Unit tests for the input path and the report layouts, run natively
+// against the mock registers. `make test` builds them twice, once as
+// configured and once with a coalescing window so that stage is covered
+// either way.
+
+#define KEY_LEFT_SHIFT 0xE1
+
+#define BIT(button) (1U << (button))
+#define MS(ms) ((ms) * (1000 / TICK_US))
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+	printf("%s:%d: %s failed\n", __FILE__, __LINE__, #condition); \
+	failures++; \
+    } \
+} while (0)
+
+uint16_t read_word(const uint8_t* bytes) {
+    return bytes[0] | bytes[1] << 8;
+}
+
+void test_debounce() {
+    input_init(NULL, 0);
+
+    // Reported on the first scan that sees it.
+    CHECK(debounce(BIT(0), 100) == BIT(0));
+    // Bounces within the lockout are swallowed.
+    CHECK(debounce(0, 101) == BIT(0));
+    CHECK(debounce(BIT(0), 102) == BIT(0));
+    CHECK(debounce(0, 100 + DEBOUNCE_TICKS - 1) == BIT(0));
+    // And the release goes through as soon as it ends.
+    CHECK(debounce(0, 100 + DEBOUNCE_TICKS) == 0);
+
+    // Other buttons aren't held up by one that's locked.
+    CHECK(debounce(BIT(1), 100 + DEBOUNCE_TICKS + 1) == BIT(1));
+    CHECK(debounce(BIT(1) | BIT(2), 100 + DEBOUNCE_TICKS + 2) == (BIT(1) | BIT(2)));
+
+    // The lockout survives the clock wrapping.
+    input_init(NULL, 0);
+    uint16_t start = 0xFFFF - DEBOUNCE_TICKS / 2;
+    CHECK(debounce(BIT(3), start) == BIT(3));
+    CHECK(debounce(0, start + DEBOUNCE_TICKS - 1) == BIT(3));
+    CHECK(debounce(0, start + DEBOUNCE_TICKS) == 0);
+}
+
+void test_socd() {
+    const SocdPair pairs[] = {
+	{BIT(0), BIT(1), SOCD_NEUTRAL},
+	{BIT(2), BIT(3), SOCD_SECOND_WINS},
+	{BIT(4), BIT(5), SOCD_LAST_WINS},
+    };
+    input_init(pairs, 3);
+
+    // One of a pair is left alone.
+    CHECK(socd_clean(BIT(0)) == BIT(0));
+    CHECK(socd_clean(BIT(1)) == BIT(1));
+    // Both of a neutral pair is neither, whatever else is held.
+    CHECK(socd_clean(BIT(0) | BIT(1) | BIT(6)) == BIT(6));
+    CHECK(socd_clean(BIT(1)) == BIT(1));
+
+    // Second wins regardless of the order they went down in.
+    CHECK(socd_clean(BIT(2)) == BIT(2));
+    CHECK(socd_clean(BIT(2) | BIT(3)) == BIT(3));
+    CHECK(socd_clean(BIT(3)) == BIT(3));
+    CHECK(socd_clean(BIT(2) | BIT(3)) == BIT(3));
+    CHECK(socd_clean(BIT(2)) == BIT(2));
+
+    // Last wins, and releasing it hands back to the one still held.
+    CHECK(socd_clean(BIT(4)) == BIT(4));
+    CHECK(socd_clean(BIT(4) | BIT(5)) == BIT(5));
+    CHECK(socd_clean(BIT(4)) == BIT(4));
+    CHECK(socd_clean(BIT(4) | BIT(5)) == BIT(5));
+    CHECK(socd_clean(BIT(5)) == BIT(5));
+    CHECK(socd_clean(BIT(4) | BIT(5)) == BIT(4));
+    // Both landing on the same scan keeps whichever won last.
+    CHECK(socd_clean(0) == 0);
+    CHECK(socd_clean(BIT(4) | BIT(5)) == BIT(4));
+
+    // Pairs are resolved independently.
+    CHECK(socd_clean(BIT(0) | BIT(1) | BIT(2) | BIT(3) | BIT(4) | BIT(5)) == (BIT(3) | BIT(4)));
+}
+
+void test_coalesce() {
+    input_init(NULL, 0);
+    uint16_t frame = 1000;
+    uint16_t late = frame + FRAME_TICKS - 1;
+
+    if (COALESCE_WINDOW_TICKS == 0) {
+	// Off, so even the last tick of a frame goes straight out.
+	CHECK(coalesce(BIT(0), late, frame) == BIT(0));
+	CHECK(coalesce(BIT(0) | BIT(1), late, frame) == (BIT(0) | BIT(1)));
+	CHECK(coalesce(0, late, frame) == 0);
+	return;
+    }
+
+    uint16_t window = frame + FRAME_TICKS - COALESCE_WINDOW_TICKS;
+
+    // Early in the frame goes straight out.
+    CHECK(coalesce(BIT(0), frame + 1, frame) == BIT(0));
+    CHECK(coalesce(BIT(0), window - 1, frame) == BIT(0));
+    // Inside the window it waits for the next SOF, along with anything else
+    // pressed before then.
+    CHECK(coalesce(BIT(0) | BIT(1), window, frame) == BIT(0));
+    CHECK(coalesce(BIT(0) | BIT(1) | BIT(2), late, frame) == BIT(0));
+    frame += FRAME_TICKS;
+    CHECK(coalesce(BIT(0) | BIT(1) | BIT(2), frame, frame) == (BIT(0) | BIT(1) | BIT(2)));
+
+    // Releases are never held back.
+    CHECK(coalesce(BIT(1), frame + FRAME_TICKS - 1, frame) == BIT(1));
+
+    // A press released before the SOF never goes out at all.
+    CHECK(coalesce(BIT(1) | BIT(3), frame + FRAME_TICKS - 1, frame) == BIT(1));
+    CHECK(coalesce(BIT(1), frame + FRAME_TICKS - 1, frame) == BIT(1));
+    frame += FRAME_TICKS;
+    CHECK(coalesce(BIT(1), frame, frame) == BIT(1));
+
+    // Without SOFs a hold lasts at most a frame.
+    uint16_t stale = frame;
+    CHECK(coalesce(BIT(1) | BIT(4), stale + FRAME_TICKS - 1, stale) == BIT(1));
+    CHECK(coalesce(BIT(1) | BIT(4), stale + FRAME_TICKS, stale) == (BIT(1) | BIT(4)));
+
+    // input_init lets go of anything held.
+    CHECK(coalesce(BIT(5), frame + FRAME_TICKS - 1, frame) == 0);
+    input_init(NULL, 0);
+    CHECK(coalesce(BIT(5), frame + 1, frame) == BIT(5));
+}
+
+void test_pipeline() {
+    const SocdPair pairs[] = {
+	{BIT(0), BIT(1), SOCD_NEUTRAL},
+    };
+    input_init(pairs, 1);
+    history_init(0);
+
+    // A bouncing direction against a held opposite one: SOCD sees the
+    // debounced word, so the pair reads neutral until the release sticks.
+    CHECK(input_process(BIT(0), 0, 0) == BIT(0));
+    CHECK(input_process(BIT(0) | BIT(1), 10, 0) == 0);
+    CHECK(input_process(BIT(0), 20, 0) == 0);
+    CHECK(input_process(BIT(0) | BIT(1), 30, 0) == 0);
+    CHECK(input_process(BIT(0), 10 + DEBOUNCE_TICKS, 0) == BIT(0));
+}
+
+void test_boot_report() {
+    uint8_t report[BOOT_REPORT_SIZE];
+    report_map_button(0, KEY_A);
+    report_map_button(1, KEY_LEFT_SHIFT);
+    report_map_button(2, KEY_STOP);
+    for (uint8_t i = 3; i < 10; i++) {
+	report_map_button(i, KEY_B + i - 3);
+    }
+
+    CHECK(REPORT_BUILDERS[0] == build_boot_report);
+    CHECK(build_boot_report(report, 0) == BOOT_REPORT_SIZE);
+    const uint8_t empty[BOOT_REPORT_SIZE] = {0};
+    CHECK(memcmp(report, empty, BOOT_REPORT_SIZE) == 0);
+
+    // Modifiers go in the first byte, scancodes fill slots from the third
+    // in button order, including ones the NKRO bitmap can't hold.
+    build_boot_report(report, BIT(0) | BIT(1) | BIT(2));
+    const uint8_t some[BOOT_REPORT_SIZE] = {KEY_MOD_LSHIFT, 0, KEY_A, KEY_STOP, 0, 0, 0, 0};
+    CHECK(memcmp(report, some, BOOT_REPORT_SIZE) == 0);
+
+    // Six keys still fit.
+    build_boot_report(report, BIT(1) | BIT(3) | BIT(4) | BIT(5) | BIT(6) | BIT(7) | BIT(8));
+    const uint8_t six[BOOT_REPORT_SIZE] = {KEY_MOD_LSHIFT, 0, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G};
+    CHECK(memcmp(report, six, BOOT_REPORT_SIZE) == 0);
+
+    // A seventh is rollover in every slot, but the modifiers stand.
+    build_boot_report(report, BIT(1) | BIT(3) | BIT(4) | BIT(5) | BIT(6) | BIT(7) | BIT(8) | BIT(9));
+    CHECK(report[0] == KEY_MOD_LSHIFT);
+    CHECK(report[1] == 0);
+    for (uint8_t i = 2; i < BOOT_REPORT_SIZE; i++) {
+	CHECK(report[i] == KEY_ERR_OVF);
+    }
+}
+
+void test_nkro_report() {
+    uint8_t report[KEYBOARD_REPORT_SIZE];
+    report_map_button(0, KEY_A);
+    report_map_button(1, KEY_LEFT_SHIFT);
+    report_map_button(2, KEY_STOP);
+    report_map_button(3, NKRO_MAX_USAGE);
+
+    CHECK(REPORT_BUILDERS[1] == build_nkro_report);
+    memset(report, 0xAA, sizeof(report));
+    CHECK(build_nkro_report(report, BIT(0) | BIT(1) | BIT(2) | BIT(3)) == NKRO_REPORT_SIZE);
+
+    uint8_t expected[NKRO_REPORT_SIZE] = {0};
+    expected[0] = KEY_MOD_LSHIFT;
+    expected[1 + KEY_A / 8] = 1 << (KEY_A % 8);
+    // KEY_STOP is past the bitmap and left out, and the reserved byte stays
+    // clear.
+    expected[NKRO_BITMAP_SIZE] = 0x80;
+    CHECK(memcmp(report, expected, NKRO_REPORT_SIZE) == 0);
+
+    build_nkro_report(report, 0);
+    memset(expected, 0, NKRO_REPORT_SIZE);
+    CHECK(memcmp(report, expected, NKRO_REPORT_SIZE) == 0);
+}
+
+void test_axes_report() {
+    uint8_t report[JOYSTICK_REPORT_SIZE];
+    for (uint8_t i = 0; i < ANALOG_AXIS_COUNT; i++) {
+	analog_axes[i] = 0x10 + i;
+    }
+
+    memset(report, 0xAA, sizeof(report));
+    CHECK(build_axes_report(report) == AXES_REPORT_SIZE);
+    const uint8_t expected[AXES_REPORT_SIZE] = {0x10, 0x11, 0x12};
+    CHECK(memcmp(report, expected, AXES_REPORT_SIZE) == 0);
+
+    for (uint8_t i = 0; i < ANALOG_AXIS_COUNT; i++) {
+	analog_axes[i] = 0;
+    }
+}
+
+void test_xinput_report() {
+    uint8_t report[XINPUT_REPORT_SIZE];
+    report_map_xinput(0, XINPUT_A);
+    report_map_xinput(1, XINPUT_DPAD_UP);
+    report_map_xinput(2, XINPUT_LEFT_TRIGGER);
+    report_map_xinput(3, XINPUT_RIGHT_TRIGGER);
+    report_map_xinput(4, XINPUT_NONE);
+    report_map_xinput(5, XINPUT_GUIDE);
+
+    CHECK(XINPUT_REPORT_BUILDERS[0] == build_xinput_report);
+    CHECK(XINPUT_REPORT_BUILDERS[1] == build_xinput_report);
+
+    memset(report, 0xAA, sizeof(report));
+    CHECK(build_xinput_report(report, 0) == XINPUT_REPORT_SIZE);
+    uint8_t expected[XINPUT_REPORT_SIZE] = {0x00, XINPUT_REPORT_SIZE};
+    CHECK(memcmp(report, expected, XINPUT_REPORT_SIZE) == 0);
+
+    // The button word is little endian, the triggers all or nothing.
+    build_xinput_report(report, BIT(0) | BIT(1) | BIT(2) | BIT(4) | BIT(5));
+    expected[XINPUT_BUTTONS_OFFSET] = BIT(XINPUT_DPAD_UP);
+    expected[XINPUT_BUTTONS_OFFSET + 1] = (BIT(XINPUT_A) | BIT(XINPUT_GUIDE)) >> 8;
+    expected[XINPUT_LEFT_TRIGGER_OFFSET] = 0xFF;
+    CHECK(memcmp(report, expected, XINPUT_REPORT_SIZE) == 0);
+
+    build_xinput_report(report, BIT(3));
+    CHECK(read_word(report + XINPUT_BUTTONS_OFFSET) == 0);
+    CHECK(report[XINPUT_LEFT_TRIGGER_OFFSET] == 0);
+    CHECK(report[XINPUT_RIGHT_TRIGGER_OFFSET] == 0xFF);
+
+    // Remapping a trigger button takes it off the trigger.
+    report_map_xinput(2, XINPUT_B);
+    build_xinput_report(report, BIT(2));
+    CHECK(read_word(report + XINPUT_BUTTONS_OFFSET) == BIT(XINPUT_B));
+    CHECK(report[XINPUT_LEFT_TRIGGER_OFFSET] == 0);
+}
+
+void ADC_vect(void);
+
+// Runs a full oversampled reading of sample through the ADC interrupt.
+uint8_t read_axis(uint16_t sample) {
+    for (uint8_t i = 0; i < 1 << (2 * ANALOG_EXTRA_BITS); i++) {
+	ADC = sample;
+	ADC_vect();
+    }
+    return analog_axes[0];
+}
+
+void test_analog_axis() {
+    const AnalogChannel full[] = {
+	{0, ANALOG_AXIS, 0, ANALOG_MAX_VALUE, 0},
+    };
+    analog_init(full, 1);
+    CHECK(analog_axes[0] == 128);
+
+    // Every reading lands on the nearest count, so the ends and the
+    // center come out exact and nothing jumps near the top.
+    for (uint16_t sample = 0; sample < 1024; sample++) {
+	uint16_t value = sample << ANALOG_EXTRA_BITS;
+	CHECK(read_axis(sample) == (value * 255UL + ANALOG_MAX_VALUE / 2) / ANALOG_MAX_VALUE);
+    }
+    CHECK(read_axis(0) == 0);
+    CHECK(read_axis(512) == 128);
+    CHECK(read_axis(1023) == 255);
+
+    const AnalogChannel narrow[] = {
+	{0, ANALOG_AXIS, 1000, 1100, 3},
+    };
+    analog_init(narrow, 1);
+    CHECK(read_axis(400) == 0);
+    CHECK(read_axis(500) == 0);
+    CHECK(read_axis(525) == 128);
+    // Just outside the deadzone.
+    CHECK(read_axis(508) == 41);
+    CHECK(read_axis(534) == 173);
+    CHECK(read_axis(550) == 255);
+    CHECK(read_axis(600) == 255);
+    analog_stop();
+}
+
+// Reading the report in pieces has to give the same bytes as all at once,
+// the USB interrupt asks for it a packet at a time.
+void check_chunked(void (*read_report)(uint8_t, uint8_t*, uint8_t), uint8_t size) {
+    uint8_t whole[256];
+    uint8_t pieces[256];
+    read_report(0, whole, size);
+    for (uint8_t chunk = 1; chunk <= 32; chunk++) {
+	for (uint16_t offset = 0; offset < size; offset += chunk) {
+	    uint8_t length = size - offset < chunk ? size - offset : chunk;
+	    read_report(offset, pieces + offset, length);
+	}
+	CHECK(memcmp(whole, pieces, size) == 0);
+    }
+}
+
+void test_health() {
+    uint8_t report[HEALTH_REPORT_SIZE];
+    health_init();
+    uint16_t now = 0;
+    health_update(0, 0, now);
+
+    // Button 2: a press that bounces twice, held for 250 ms.
+    health_update(BIT(2), BIT(2), now += 1);
+    health_update(0, BIT(2), now += 10);
+    health_update(BIT(2), BIT(2), now += 10);
+    health_update(0, 0, now += MS(250) - 20);
+    // Then a longer one, which doesn't replace the shortest.
+    health_update(BIT(2), BIT(2), now += MS(10));
+    health_update(BIT(2), BIT(2), now += MS(150));
+    health_update(0, 0, now += MS(150));
+
+    // Button 5: held down across several clock wraps.
+    health_update(BIT(5), BIT(5), now += 1);
+    for (uint8_t i = 0; i < 5; i++) {
+	health_update(BIT(5), BIT(5), now += MS(200));
+    }
+
+    health_read_report(0, report, HEALTH_REPORT_SIZE);
+    uint8_t* entry = report + 2 * HEALTH_ENTRY_SIZE;
+    CHECK(read_word(entry) == 2);
+    CHECK(read_word(entry + 2) == 2);
+    CHECK(read_word(entry + 4) == 250);
+    CHECK(read_word(entry + 6) == 0);
+
+    entry = report + 5 * HEALTH_ENTRY_SIZE;
+    CHECK(read_word(entry) == 1);
+    CHECK(read_word(entry + 2) == 0);
+    CHECK(read_word(entry + 4) == 0xFFFF);
+    CHECK(read_word(entry + 6) == 1000);
+
+    // Untouched buttons have nothing to report.
+    entry = report + 7 * HEALTH_ENTRY_SIZE;
+    const uint8_t untouched[HEALTH_ENTRY_SIZE] = {0, 0, 0, 0, 0xFF, 0xFF, 0, 0};
+    CHECK(memcmp(entry, untouched, HEALTH_ENTRY_SIZE) == 0);
+
+    check_chunked(health_read_report, HEALTH_REPORT_SIZE);
+
+    // health_init starts the counts over.
+    health_init();
+    health_read_report(0, report, HEALTH_REPORT_SIZE);
+    CHECK(memcmp(report + 2 * HEALTH_ENTRY_SIZE, untouched, HEALTH_ENTRY_SIZE) == 0);
+}
+
+void test_history() {
+    uint8_t report[HISTORY_REPORT_SIZE];
+    uint16_t chord = BIT(0) | BIT(1);
+    history_init(chord);
+    uint16_t now = 0;
+    history_record(0, now);
+
+    history_read_report(0, report, HISTORY_REPORT_SIZE);
+    CHECK(report[0] == 0);
+    CHECK(report[1] == 0);
+    CHECK(read_word(report + 2) == HISTORY_TICKS_PER_UNIT * TICK_US);
+
+    // Only changes are recorded, with the time since the last one.
+    history_record(BIT(2), now += 1);
+    history_record(BIT(2), now += 50 * HISTORY_TICKS_PER_UNIT);
+    history_record(BIT(2) | BIT(9), now += 50 * HISTORY_TICKS_PER_UNIT);
+    // Remainders carry over instead of drifting, so two half units add up
+    // to one between them.
+    history_record(BIT(9), now += HISTORY_TICKS_PER_UNIT / 2);
+    history_record(0, now += HISTORY_TICKS_PER_UNIT / 2);
+    // Deltas saturate past about 4 s.
+    for (uint8_t i = 0; i < 20; i++) {
+	history_record(0, now += MS(250));
+    }
+    history_record(BIT(3), now += 1);
+
+    history_read_report(0, report, HISTORY_REPORT_SIZE);
+    CHECK(report[0] == 5);
+    uint8_t* entry = report + HISTORY_HEADER_SIZE;
+    CHECK(read_word(entry + 2) == BIT(2));
+    entry += HISTORY_ENTRY_SIZE;
+    CHECK(read_word(entry) == 100);
+    CHECK(read_word(entry + 2) == (BIT(2) | BIT(9)));
+    entry += HISTORY_ENTRY_SIZE;
+    CHECK(read_word(entry + 2) == BIT(9));
+    CHECK(read_word(entry) + read_word(entry + HISTORY_ENTRY_SIZE) == 1);
+    entry += HISTORY_ENTRY_SIZE;
+    CHECK(read_word(entry + 2) == 0);
+    entry += HISTORY_ENTRY_SIZE;
+    CHECK(read_word(entry) == 0xFFFF);
+    CHECK(read_word(entry + 2) == BIT(3));
+    // Past the last entry reads as zeros.
+    entry += HISTORY_ENTRY_SIZE;
+    const uint8_t unused[HISTORY_ENTRY_SIZE] = {0};
+    CHECK(memcmp(entry, unused, HISTORY_ENTRY_SIZE) == 0);
+
+    // Once full, the oldest entries make way.
+    history_init(chord);
+    for (uint16_t i = 1; i <= HISTORY_LENGTH + 10; i++) {
+	history_record(i << 2, now += HISTORY_TICKS_PER_UNIT);
+    }
+    history_read_report(0, report, HISTORY_REPORT_SIZE);
+    CHECK(report[0] == HISTORY_LENGTH);
+    CHECK(read_word(report + HISTORY_HEADER_SIZE + 2) == 11 << 2);
+    CHECK(read_word(report + HISTORY_REPORT_SIZE - 2) == (HISTORY_LENGTH + 10) << 2);
+    check_chunked(history_read_report, HISTORY_REPORT_SIZE);
+
+    // The chord freezes it, changes meanwhile are dropped, and the chord
+    // again resumes with that press as the next entry.
+    history_init(chord);
+    history_record(BIT(2), now += 1);
+    history_record(BIT(0), now += 1);
+    history_record(chord, now += 1);
+    history_record(BIT(0) | BIT(3), now += 1);
+    history_record(BIT(3), now += 1);
+    history_read_report(0, report, HISTORY_REPORT_SIZE);
+    CHECK(report[0] == 2);
+    CHECK(report[1] == HISTORY_FROZEN);
+    CHECK(read_word(report + HISTORY_HEADER_SIZE + HISTORY_ENTRY_SIZE + 2) == BIT(0));
+
+    history_record(0, now += 1);
+    history_record(chord, now += 1);
+    history_read_report(0, report, HISTORY_REPORT_SIZE);
+    CHECK(report[0] == 3);
+    CHECK(report[1] == 0);
+    CHECK(read_word(report + HISTORY_HEADER_SIZE + 2 * HISTORY_ENTRY_SIZE + 2) == chord);
+}
+
+int main(int argc, char** argv) {
+    test_debounce();
+    test_socd();
+    test_coalesce();
+    test_pipeline();
+    test_boot_report();
+    test_nkro_report();
+    test_axes_report();
+    test_xinput_report();
+    test_analog_axis();
+    test_health();
+    test_history();
+
+    if (failures) {
+	printf("%d checks failed\n", failures);
+	return 1;
+    }
+    printf("All checks passed (coalescing window %d us)\n", COALESCE_WINDOW_US);
+    return 0;
+}
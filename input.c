@@ -0,0 +1,107 @@
+#include "input.h"
+
+#include "report.h"
+
+static uint16_t debounced = 0;
+static uint16_t locked = 0;
+static uint16_t unlock_at[MAX_BUTTONS];
+
+static const SocdPair* socd_pairs;
+static uint8_t socd_pair_count = 0;
+// Per pair, the one of the two that was pressed last.
+static uint16_t socd_last[SOCD_MAX_PAIRS];
+static uint16_t socd_previous = 0;
+
+static uint16_t coalesced = 0;
+static uint16_t held = 0;
+static uint16_t held_frame_start = 0;
+
+void input_init(const SocdPair* pairs, uint8_t count) {
+    socd_pairs = pairs;
+    socd_pair_count = count;
+    for (uint8_t i = 0; i < count; i++) {
+	socd_last[i] = pairs[i].first;
+    }
+    debounced = 0;
+    locked = 0;
+    socd_previous = 0;
+    coalesced = 0;
+    held = 0;
+    health_init();
+}
+
+uint16_t debounce(uint16_t raw, uint16_t now) {
+    // Only buttons that changed since the last edge cost more than the
+    // few word-wide operations here.
+    if (locked) {
+	uint16_t bit = 1;
+	for (uint8_t i = 0; i < MAX_BUTTONS; i++, bit <<= 1) {
+	    if ((locked & bit) && (int16_t)(now - unlock_at[i]) >= 0) {
+		locked &= ~bit;
+	    }
+	}
+    }
+
+    uint16_t changed = (raw ^ debounced) & ~locked;
+    if (changed) {
+	debounced ^= changed;
+	locked |= changed;
+
+	uint16_t bit = 1;
+	for (uint8_t i = 0; i < MAX_BUTTONS; i++, bit <<= 1) {
+	    if (changed & bit) {
+		unlock_at[i] = now + DEBOUNCE_TICKS;
+	    }
+	}
+    }
+    return debounced;
+}
+
+uint16_t socd_clean(uint16_t buttons) {
+    uint16_t pressed = buttons & ~socd_previous;
+    socd_previous = buttons;
+
+    for (uint8_t i = 0; i < socd_pair_count; i++) {
+	const SocdPair* pair = &socd_pairs[i];
+	uint16_t both = pair->first | pair->second;
+
+	if ((pressed & both) == pair->first || (pressed & both) == pair->second) {
+	    socd_last[i] = pressed & both;
+	}
+	if ((buttons & both) != both) {
+	    continue;
+	}
+
+	if (pair->mode == SOCD_NEUTRAL) {
+	    buttons &= ~both;
+	} else if (pair->mode == SOCD_LAST_WINS) {
+	    buttons &= ~both | socd_last[i];
+	} else {
+	    buttons &= ~pair->first;
+	}
+    }
+    return buttons;
+}
+
+uint16_t coalesce(uint16_t buttons, uint16_t now, uint16_t frame_start) {
+    if (COALESCE_WINDOW_TICKS == 0) {
+	return buttons;
+    }
+
+    // Holds end at the next SOF, or once a whole frame has gone by without
+    // one, e.g. while the host isn't sending them.
+    uint16_t into_frame = now - frame_start;
+    if (held && (frame_start != held_frame_start || into_frame >= FRAME_TICKS)) {
+	held = 0;
+    }
+
+    uint16_t pressed = buttons & ~coalesced & ~held;
+    if (pressed && into_frame >= FRAME_TICKS - COALESCE_WINDOW_TICKS && into_frame < FRAME_TICKS) {
+	held |= pressed;
+	held_frame_start = frame_start;
+    }
+
+    held &= buttons;
+    coalesced = buttons & ~held;
+    return coalesced;
+}
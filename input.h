@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "clock.h"
+#include "health.h"
+#include "history.h"
+
+// The stages between scanning and building a report. All of them work on
+// the packed button word (bit i = button i pressed) and touch no
+// registers, so they build natively too.
+
+// Eager debounce: an edge is reported on the scan that sees it, and the
+// button is then locked for DEBOUNCE_US so contact bounce can't produce
+// another edge.
+#define DEBOUNCE_US 5000
+#define DEBOUNCE_TICKS (DEBOUNCE_US / TICK_US)
+
+typedef enum {
+    // Both held reads as neither.
+    SOCD_NEUTRAL,
+    // Both held reads as whichever was pressed last.
+    SOCD_LAST_WINS,
+    // Both held reads as second, e.g. up over down on a hitbox.
+    SOCD_SECOND_WINS,
+} socd_mode_t;
+
+// Simultaneous opposing cardinal directions, and how to resolve them.
+typedef struct {
+    uint16_t first;
+    uint16_t second;
+    socd_mode_t mode;
+} SocdPair;
+
+#define SOCD_MAX_PAIRS 4
+
+// Presses that land in the last COALESCE_WINDOW_US of a USB frame are held
+// back until the next SOF, so a two or three button press that straddles
+// the frame boundary still goes out in a single report. 0 turns the stage
+// off and adds no latency. Overridable so `make test` covers the stage too.
+#ifndef COALESCE_WINDOW_US
+#define COALESCE_WINDOW_US 0
+#endif
+#define COALESCE_WINDOW_TICKS (COALESCE_WINDOW_US / TICK_US)
+#define FRAME_TICKS (1000 / TICK_US)
+
+_Static_assert(COALESCE_WINDOW_TICKS < FRAME_TICKS, "Coalescing window must be shorter than a frame");
+
+// pairs must outlive the pipeline. Also resets the health counters.
+void input_init(const SocdPair* pairs, uint8_t count);
+
+uint16_t debounce(uint16_t raw, uint16_t now);
+uint16_t socd_clean(uint16_t buttons);
+// frame_start is clock_ticks() at the last SOF.
+uint16_t coalesce(uint16_t buttons, uint16_t now, uint16_t frame_start);
+
+static inline uint16_t input_process(uint16_t raw, uint16_t now, uint16_t frame_start) {
+    uint16_t debounced = debounce(raw, now);
+    health_update(raw, debounced, now);
+    history_record(debounced, now);
+    return coalesce(socd_clean(debounced), now, frame_start);
+}
@@ -0,0 +1,42 @@
+#include "latency_test.h"
+
+#include "clock.h"
+#include "report.h"
+#include "tools/pattern.h"
+#include "usb.h"
+
+_Static_assert(256 % PATTERN_PERIOD_FRAMES == 0, "Period must divide the 8-bit frame counter");
+_Static_assert(PATTERN_NKRO_COUNTER_BYTE == NKRO_RESERVED_OFFSET, "tools/pattern.h is out of date with the NKRO layout");
+
+// Both layouts have a reserved byte, so the counter never lands in the key
+// bitmap where the host would see it as keypresses.
+static const uint8_t COUNTER_OFFSETS[2] = {
+    PATTERN_COUNTER_BYTE,
+    PATTERN_NKRO_COUNTER_BYTE,
+};
+
+// Two frames, past which SOFs have stopped.
+#define SOF_TIMEOUT_TICKS (2000 / TICK_US)
+
+static uint8_t frame = 0;
+
+uint16_t latency_test_next_frame() {
+    // Without SOFs the frame number never moves, e.g. before enumeration,
+    // and this runs in the scan task, so don't wait on one that won't come.
+    uint16_t start = clock_ticks();
+    while ((uint8_t)usb_frame_number() == frame) {
+	if (usb_state != USB_STATE_ATTACHED || usb_suspended || (uint16_t)(clock_ticks() - start) >= SOF_TIMEOUT_TICKS) {
+	    break;
+	}
+    }
+    frame = usb_frame_number();
+
+    if ((frame / PATTERN_PERIOD_FRAMES) & 1) {
+	return 1 << LATENCY_TEST_BUTTON;
+    }
+    return 0;
+}
+
+void latency_test_stamp(uint8_t* report, uint8_t protocol) {
+    report[COUNTER_OFFSETS[protocol]] = frame;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+// End-to-end latency test pattern, see tools/pattern.h for what the host
+// side expects. Instead of the buttons, LATENCY_TEST_BUTTON toggles every
+// PATTERN_PERIOD_FRAMES frames, and every report carries the frame number
+// it was built in so tools/hidraw_analyzer can match it to the host's
+// arrival time.
+
+// Pressed in the pattern, button 0 is a direction on every layout.
+#define LATENCY_TEST_BUTTON 0
+
+// Waits for the next SOF and returns the pattern's button word for that
+// frame. Returns the current frame's straight away while the host hasn't
+// configured us or has the bus suspended, and after two frames without an
+// SOF.
+uint16_t latency_test_next_frame();
+
+// Writes the frame number into the spare byte of a report built for the
+// given protocol.
+void latency_test_stamp(uint8_t* report, uint8_t protocol);
@@ -0,0 +1,309 @@
+#define F_CPU 16000000
+
+#include "layout.h"
+
+#include "analog.h"
+#include "hal.h"
+#include "input.h"
+#include "keys.h"
+#include "report.h"
+
+// Set to 1 to scan a diode matrix (see matrix below) instead of wiring every
+// button to its own pin.
+#define SCAN_MATRIX 0
+
+#if SCAN_MATRIX && PLAYER_COUNT == 2
+#error "Two player mode needs every button on a pin of its own"
+#endif
+
+#if SCAN_MATRIX
+
+// MATRIX_ROWS(X) lists the row pins as X(pin). The columns are
+// MATRIX_COLUMN_COUNT consecutive pins of one port from MATRIX_FIRST_COLUMN
+// on. Both get the same build time checks as direct-wired buttons.
+#define MATRIX_ROWS(X) \
+    X(PIN_D2) \
+    X(PIN_D3) \
+    X(PIN_D4)
+
+#define MATRIX_FIRST_COLUMN PIN_D15  // PB1-PB5: D15, D16, D14, D8, D9
+#define MATRIX_COLUMN_COUNT 5
+
+#define ROW_ONE(pin) + 1
+#define ROW_PIN(pin) pin,
+#define ROW_PIN_BITS(pin) | PIN_BIT(pin)
+#define ROW_PIN_SUM(pin) + PIN_BIT(pin)
+#define ROW_CHECK(pin) _Static_assert(PIN_EXISTS(pin), #pin " isn't a pin matrix rows can use");
+
+#define MATRIX_ROW_COUNT (0 MATRIX_ROWS(ROW_ONE))
+#define BUTTON_COUNT (MATRIX_ROW_COUNT * MATRIX_COLUMN_COUNT)
+
+// The columns' bits of their port, and of PIN_BIT.
+#define MATRIX_COLUMN_MASK (((1 << MATRIX_COLUMN_COUNT) - 1) << (MATRIX_FIRST_COLUMN & 0b111))
+#define MATRIX_COLUMN_PIN_BITS (((1ULL << MATRIX_COLUMN_COUNT) - 1) << (MATRIX_FIRST_COLUMN & 0b111111))
+
+MATRIX_ROWS(ROW_CHECK)
+
+_Static_assert(MATRIX_ROW_COUNT <= MATRIX_MAX_ROWS, "Too many matrix rows");
+_Static_assert((MATRIX_FIRST_COLUMN & 0b111) + MATRIX_COLUMN_COUNT <= 8, "Matrix columns run past the end of their port");
+_Static_assert((PORT_PINS(PIN_PORT(MATRIX_FIRST_COLUMN)) & MATRIX_COLUMN_MASK) == MATRIX_COLUMN_MASK, "A matrix column isn't a pin columns can use");
+_Static_assert((0 MATRIX_ROWS(ROW_PIN_SUM)) == (0 MATRIX_ROWS(ROW_PIN_BITS)), "Two matrix rows share a pin");
+_Static_assert(((0 MATRIX_ROWS(ROW_PIN_BITS)) & MATRIX_COLUMN_PIN_BITS) == 0, "A matrix row is on a column pin");
+
+#define LAYOUT_PIN_BITS ((0 MATRIX_ROWS(ROW_PIN_BITS)) | MATRIX_COLUMN_PIN_BITS)
+
+static const pin_t matrix_rows[MATRIX_ROW_COUNT] = {
+    MATRIX_ROWS(ROW_PIN)
+};
+
+static const Matrix matrix = {
+    .rows = matrix_rows,
+    .row_count = MATRIX_ROW_COUNT,
+    .first_column = MATRIX_FIRST_COLUMN,
+    .column_count = MATRIX_COLUMN_COUNT,
+};
+
+// One row after another.
+static const uint8_t button_scancodes[BUTTON_COUNT] PROGMEM = {
+    KEY_A, KEY_S, KEY_D, KEY_W, KEY_ENTER,     // directions, start
+    KEY_J, KEY_K, KEY_L, KEY_BACKSPACE, KEY_ESC,  // punches, select, home
+    KEY_U, KEY_I, KEY_O, KEY_TAB, KEY_GRAVE,   // kicks, layout toggles
+};
+
+static const uint8_t button_xinput[BUTTON_COUNT] PROGMEM = {
+    XINPUT_DPAD_LEFT, XINPUT_DPAD_DOWN, XINPUT_DPAD_RIGHT, XINPUT_DPAD_UP, XINPUT_START,
+    XINPUT_X, XINPUT_Y, XINPUT_RIGHT_SHOULDER, XINPUT_BACK, XINPUT_GUIDE,
+    XINPUT_A, XINPUT_B, XINPUT_RIGHT_TRIGGER, XINPUT_LEFT_SHOULDER, XINPUT_LEFT_TRIGGER,
+};
+
+const uint16_t player_buttons[PLAYER_COUNT] = {
+    0xFFFF,
+};
+
+void init_pins() {
+    matrix_init(&matrix);
+}
+
+uint16_t scan_pins() {
+    return matrix_scan();
+}
+
+void enable_wake_on_buttons() {
+    matrix_drive_all_rows();
+    for (int i = 0; i < MATRIX_COLUMN_COUNT; i++) {
+	enable_wake_on_pin(matrix.first_column + i);
+    }
+}
+
+void disable_wake_on_buttons() {
+    disable_wake_on_pins();
+    matrix_release_all_rows();
+}
+
+#else
+
+// Every button on a pin of its own. BUTTONS(X) lists them in packed word
+// order as X(pin, scancode, xinput), and everything else is generated from
+// that list at build time: the keymap, the pull-ups, a straight-line scan
+// with one bit test per button, and checks that fail the build on a pin
+// the board doesn't have or a pin used twice.
+
+#if PLAYER_COUNT == 2
+
+// Eight buttons a player, player 1 on buttons 0-7 and player 2 on 8-15.
+// Player 2's directions take the analog pins, so there are no analog
+// channels in this mode. XInput is single player only.
+#define BUTTONS(X) \
+    X(PIN_D2, KEY_A, XINPUT_NONE) \
+    X(PIN_D3, KEY_S, XINPUT_NONE) \
+    X(PIN_D4, KEY_D, XINPUT_NONE) \
+    X(PIN_D6, KEY_W, XINPUT_NONE) \
+    X(PIN_D7, KEY_J, XINPUT_NONE) \
+    X(PIN_D8, KEY_K, XINPUT_NONE) \
+    X(PIN_D9, KEY_L, XINPUT_NONE) \
+    X(PIN_D10, KEY_U, XINPUT_NONE) \
+    X(PIN_A3, KEY_LEFT, XINPUT_NONE) \
+    X(PIN_A2, KEY_DOWN, XINPUT_NONE) \
+    X(PIN_A1, KEY_RIGHT, XINPUT_NONE) \
+    X(PIN_A0, KEY_UP, XINPUT_NONE) \
+    X(PIN_D14, KEY_1, XINPUT_NONE) \
+    X(PIN_D15, KEY_2, XINPUT_NONE) \
+    X(PIN_D16, KEY_3, XINPUT_NONE) \
+    X(PIN_D1, KEY_4, XINPUT_NONE)
+
+const uint16_t player_buttons[PLAYER_COUNT] = {
+    0x00FF,
+    0xFF00,
+};
+
+#else
+
+// Punches on X, Y and RB, kicks on A, B and RT, like a stick made for
+// XInput.
+#define BUTTONS(X) \
+    X(PIN_D2, KEY_A, XINPUT_DPAD_LEFT) \
+    X(PIN_D3, KEY_S, XINPUT_DPAD_DOWN) \
+    X(PIN_D4, KEY_D, XINPUT_DPAD_RIGHT) \
+    X(PIN_D6, KEY_W, XINPUT_DPAD_UP) \
+    X(PIN_D7, KEY_J, XINPUT_X) \
+    X(PIN_D8, KEY_K, XINPUT_Y) \
+    X(PIN_D9, KEY_L, XINPUT_RIGHT_SHOULDER) \
+    X(PIN_D16, KEY_U, XINPUT_A) \
+    X(PIN_D14, KEY_I, XINPUT_B) \
+    X(PIN_D15, KEY_O, XINPUT_RIGHT_TRIGGER)
+
+const uint16_t player_buttons[PLAYER_COUNT] = {
+    0xFFFF,
+};
+
+#endif
+
+#define BUTTON_ONE(pin, scancode, xinput) + 1
+#define BUTTON_SCANCODE(pin, scancode, xinput) scancode,
+#define BUTTON_XINPUT(pin, scancode, xinput) xinput,
+#define BUTTON_PIN_BITS(pin, scancode, xinput) | PIN_BIT(pin)
+#define BUTTON_PIN_SUM(pin, scancode, xinput) + PIN_BIT(pin)
+#define BUTTON_CHECK(pin, scancode, xinput) \
+    _Static_assert(PIN_EXISTS(pin), #pin " isn't a pin buttons can use");
+#define BUTTON_PULL_UP(pin, scancode, xinput) PIN_PULL_UP(pin);
+#define BUTTON_SCAN(pin, scancode, xinput) \
+    if (PIN_IS_LOW(pin)) { \
+	pressed |= bit; \
+    } \
+    bit <<= 1;
+#define BUTTON_WAKE(pin, scancode, xinput) enable_wake_on_pin(pin);
+
+#define BUTTON_COUNT (0 BUTTONS(BUTTON_ONE))
+
+BUTTONS(BUTTON_CHECK)
+
+// With every bit distinct the sum is the same as the union, any pin used
+// twice carries into another bit.
+_Static_assert((0 BUTTONS(BUTTON_PIN_SUM)) == (0 BUTTONS(BUTTON_PIN_BITS)), "Two buttons share a pin");
+
+#define LAYOUT_PIN_BITS (0 BUTTONS(BUTTON_PIN_BITS))
+
+static const uint8_t button_scancodes[BUTTON_COUNT] PROGMEM = {
+    BUTTONS(BUTTON_SCANCODE)
+};
+
+static const uint8_t button_xinput[BUTTON_COUNT] PROGMEM = {
+    BUTTONS(BUTTON_XINPUT)
+};
+
+void init_pins() {
+    BUTTONS(BUTTON_PULL_UP)
+}
+
+uint16_t scan_pins() {
+    // bit is a constant at every step, so each button comes down to a
+    // skip-if-bit-set on its port and an or.
+    uint16_t pressed = 0;
+    uint16_t bit = 1;
+    BUTTONS(BUTTON_SCAN)
+    return pressed;
+}
+
+void enable_wake_on_buttons() {
+    BUTTONS(BUTTON_WAKE)
+}
+
+void disable_wake_on_buttons() {
+    disable_wake_on_pins();
+}
+
+#endif
+
+#if PLAYER_COUNT == 2
+
+#define ANALOG_BUTTON_COUNT 0
+
+#else
+
+// Axis channels feed the report axes in order, digital channels become
+// buttons BUTTON_COUNT and up. ANALOG_CHANNELS(X) lists them as
+// X(pin, type, low, high, deadzone), checked like the buttons, and they
+// have to be ADC pins, which are all on port F.
+//
+// Left lever, right lever, slider and a digital button.
+#define ANALOG_CHANNELS(X) \
+    X(PIN_A0, ANALOG_AXIS, 0, ANALOG_MAX_VALUE, 8) \
+    X(PIN_A1, ANALOG_AXIS, 0, ANALOG_MAX_VALUE, 8) \
+    X(PIN_A2, ANALOG_AXIS, 0, ANALOG_MAX_VALUE, 0) \
+    X(PIN_A3, ANALOG_DIGITAL, ANALOG_MAX_VALUE / 3, 2 * ANALOG_MAX_VALUE / 3, 0)
+
+#define ANALOG_ONE(pin, type, low, high, deadzone) + 1
+#define ANALOG_CHANNEL(pin, type, low, high, deadzone) {ADC_CHANNEL(pin), type, low, high, deadzone},
+#define ANALOG_PIN_BITS(pin, type, low, high, deadzone) | PIN_BIT(pin)
+#define ANALOG_PIN_SUM(pin, type, low, high, deadzone) + PIN_BIT(pin)
+#define ANALOG_CHECK(pin, type, low, high, deadzone) \
+    _Static_assert(PIN_EXISTS(pin) && PIN_PORT(pin) == 4, #pin " isn't an ADC pin");
+
+#define ANALOG_CHANNEL_COUNT (0 ANALOG_CHANNELS(ANALOG_ONE))
+#define ANALOG_BUTTON_COUNT 1
+
+ANALOG_CHANNELS(ANALOG_CHECK)
+
+_Static_assert((0 ANALOG_CHANNELS(ANALOG_PIN_SUM)) == (0 ANALOG_CHANNELS(ANALOG_PIN_BITS)), "Two analog channels share a pin");
+_Static_assert((LAYOUT_PIN_BITS & (0 ANALOG_CHANNELS(ANALOG_PIN_BITS))) == 0, "A button is on an analog channel's pin");
+
+static const AnalogChannel analog_channels[ANALOG_CHANNEL_COUNT] = {
+    ANALOG_CHANNELS(ANALOG_CHANNEL)
+};
+
+static const uint8_t analog_button_scancodes[ANALOG_BUTTON_COUNT] PROGMEM = {
+    KEY_P,
+};
+
+static const uint8_t analog_button_xinput[ANALOG_BUTTON_COUNT] PROGMEM = {
+    XINPUT_LEFT_SHOULDER,
+};
+
+#endif
+
+_Static_assert(BUTTON_COUNT + ANALOG_BUTTON_COUNT <= MAX_BUTTONS, "Too many buttons for the packed button word");
+_Static_assert((LAYOUT_PIN_BITS & (PIN_BIT(PIN_RXLED) | PIN_BIT(PIN_TXLED))) == 0, "A button is on an LED pin");
+
+
+// Opposing directions, resolved hitbox style: left + right is neutral and
+// up wins over down.
+#if PLAYER_COUNT == 2
+#define SOCD_PAIR_COUNT 4
+#else
+#define SOCD_PAIR_COUNT 2
+#endif
+
+static const SocdPair socd_pairs[SOCD_PAIR_COUNT] = {
+    {1 << 0, 1 << 2, SOCD_NEUTRAL},      // KEY_A left, KEY_D right
+    {1 << 1, 1 << 3, SOCD_SECOND_WINS},  // KEY_S down, KEY_W up
+#if PLAYER_COUNT == 2
+    {1 << 8, 1 << 10, SOCD_NEUTRAL},     // Player 2 left, right
+    {1 << 9, 1 << 11, SOCD_SECOND_WINS}, // Player 2 down, up
+#endif
+};
+
+void layout_init() {
+    init_pins();
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+	report_map_button(i, pgm_read_byte(&button_scancodes[i]));
+	report_map_xinput(i, pgm_read_byte(&button_xinput[i]));
+    }
+#if PLAYER_COUNT == 2
+    analog_init(NULL, 0);
+#else
+    for (int i = 0; i < ANALOG_BUTTON_COUNT; i++) {
+	report_map_button(BUTTON_COUNT + i, pgm_read_byte(&analog_button_scancodes[i]));
+	report_map_xinput(BUTTON_COUNT + i, pgm_read_byte(&analog_button_xinput[i]));
+    }
+    analog_init(analog_channels, ANALOG_CHANNEL_COUNT);
+#endif
+    input_init(socd_pairs, SOCD_PAIR_COUNT);
+}
+
+uint16_t scan_buttons() {
+#if PLAYER_COUNT == 2
+    return scan_pins();
+#else
+    return scan_pins() | ((uint16_t)analog_buttons << BUTTON_COUNT);
+#endif
+}
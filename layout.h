@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+// The board: which pins (or matrix positions) and analog channels are which
+// buttons, and which of them are opposing directions. layout.c is the only
+// place that includes hal.h.
+
+// Held while plugging in, starts the latency test pattern instead of the
+// normal input path. All four directions, so it can't happen by accident.
+// Boot chords have to be the only buttons held, so holding one chord that
+// contains another doesn't set both off.
+#define LATENCY_TEST_CHORD 0b1111
+
+// Held while plugging in, comes up as an XInput controller instead of a
+// keyboard. Buttons 5 and 6: the first and second punch (J and K) on the
+// matrix, the second and third punch (K and L) when direct wired. Single
+// player only.
+#define XINPUT_CHORD 0b1100000
+
+// Held during play, freezes the input history (and unfreezes it again).
+// All four directions plus button 4: start on the matrix, the first punch
+// when direct wired.
+#define HISTORY_FREEZE_CHORD 0b11111
+
+// Set to 2 to serve two players from one board, each on a keyboard
+// interface of its own. Both players' buttons share the packed word and go
+// through the input path together, player_buttons says whose is whose.
+#define PLAYER_COUNT 1
+
+extern const uint16_t player_buttons[PLAYER_COUNT];
+
+// Configures the pins, analog channels, report mapping and input pipeline.
+void layout_init();
+
+// Raw packed button word, straight from the pins with no debouncing.
+uint16_t scan_buttons();
+
+// Arms the buttons as wake sources for power-down, and disarms them again.
+void enable_wake_on_buttons();
+void disable_wake_on_buttons();
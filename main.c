@@ -1,19 +1,30 @@
 #define F_CPU 16000000
 
+#include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 #include <stdlib.h>
 #include <string.h>
 #include <util/delay.h>
 
-#include "hal.h"
-#include "keys.h"
+#include "analog.h"
+#include "clock.h"
+#include "eeprom_queue.h"
+#include "health.h"
+#include "history.h"
+#include "input.h"
+#include "latency_test.h"
+#include "layout.h"
+#include "report.h"
+#include "scheduler.h"
 #include "usb.h"
 
-#define BUTTON_COUNT 10
-
 // TODO(crockeo): make this into a struct, instead of a series of bytes.
 // and that also means finding the spec which defines this thing...
+//
+// This describes the report protocol (NKRO) layout from report.h. Hosts that
+// switch to boot protocol ignore it and read the fixed 8-byte boot layout.
 static const uint8_t keyboard_report_descriptor[] PROGMEM = {
     0x05,
     0x01,  // Usage Page - Generic Desktop - HID Spec Appendix E E.6 - The
@@ -42,12 +53,6 @@ static const uint8_t keyboard_report_descriptor[] PROGMEM = {
     0x81,
     0x02,  // Input - These are variable inputs
     0x95,
-    0x01,  // Report Count - 1
-    0x75,
-    0x08,  // Report Size - 8
-    0x81,
-    0x01,  // This byte is reserved according to the spec
-    0x95,
     0x05,  // Report Count - This is for the keyboard LEDs
     0x75,
     0x01,  // Report Size
@@ -67,21 +72,109 @@ static const uint8_t keyboard_report_descriptor[] PROGMEM = {
     0x91,
     0x01,  // Output - Constant for padding
     0x95,
-    0x06,  // Report Count - For the keys
+    NKRO_MAX_USAGE + 1,  // Report Count - One bit for every key
     0x75,
-    0x08,  // Report Size - For the keys
+    0x01,  // Report Size - 1 bit
     0x15,
     0x00,  // Logical Minimum
     0x25,
-    0x65,  // Logical Maximum
+    0x01,  // Logical Maximum
     0x05,
     0x07,  // Usage Page - Key Codes
     0x19,
     0x00,  // Usage Minimum - 0
     0x29,
-    0x65,  // Usage Maximum - 101
+    NKRO_MAX_USAGE,  // Usage Maximum
+    0x81,
+    0x02,  // Input - Data, Variable, the key bitmap
+    0x95,
+    0x01,  // Report Count - 1
+    0x75,
+    0x08,  // Report Size - 8
+    0x81,
+    0x01,  // Input - Constant, the reserved byte
+    0xC0   // End collection
+};
+
+#if PLAYER_COUNT == 1
+// The analog axes from report.h, a collection and interface of their own so
+// hosts don't hide them behind the keyboard.
+static const uint8_t joystick_report_descriptor[] PROGMEM = {
+    0x05,
+    0x01,  // Usage Page - Generic Desktop
+    0x09,
+    0x04,  // Usage - Joystick
+    0xA1,
+    0x01,  // Collection - Application
+    0x09,
+    0x30,  // Usage - X, left lever
+    0x09,
+    0x31,  // Usage - Y, right lever
+    0x09,
+    0x36,  // Usage - Slider
+    0x15,
+    0x00,  // Logical Minimum - 0
+    0x26,
+    0xFF,
+    0x00,  // Logical Maximum - 255
+    0x95,
+    ANALOG_AXIS_COUNT,  // Report Count - One per axis
+    0x75,
+    0x08,  // Report Size - 8
+    0x81,
+    0x02,  // Input - Data, Variable, Absolute, the analog axes
+    0xC0   // End collection
+};
+#endif
+
+// Vendor-defined interface for config and telemetry. Reports are opaque
+// VENDOR_DATA_SIZE byte blobs in both directions, plus feature reports
+// with the button health counters and the input history.
+static const uint8_t vendor_report_descriptor[] PROGMEM = {
+    0x06,
+    0x00,
+    0xFF,  // Usage Page - Vendor Defined 0xFF00
+    0x09,
+    0x01,  // Usage - Vendor Usage 1
+    0xA1,
+    0x01,  // Collection - Application
+    0x15,
+    0x00,  // Logical Minimum - 0
+    0x26,
+    0xFF,
+    0x00,  // Logical Maximum - 255
+    0x75,
+    0x08,  // Report Size - 8
+    0x85,
+    VENDOR_REPORT_ID_DATA,  // Report ID
+    0x95,
+    VENDOR_DATA_SIZE,  // Report Count
+    0x09,
+    0x02,  // Usage - Telemetry
     0x81,
-    0x00,  // Input - Data, Array
+    0x02,  // Input - Data, Variable, Absolute
+    0x95,
+    VENDOR_DATA_SIZE,  // Report Count
+    0x09,
+    0x03,  // Usage - Config
+    0x91,
+    0x02,  // Output - Data, Variable, Absolute
+    0x85,
+    VENDOR_REPORT_ID_HEALTH,  // Report ID
+    0x95,
+    HEALTH_REPORT_SIZE,  // Report Count
+    0x09,
+    0x04,  // Usage - Button health, see health.h
+    0xB1,
+    0x02,  // Feature - Data, Variable, Absolute
+    0x85,
+    VENDOR_REPORT_ID_HISTORY,  // Report ID
+    0x95,
+    HISTORY_REPORT_SIZE,  // Report Count
+    0x09,
+    0x05,  // Usage - Input history, see history.h
+    0xB1,
+    0x02,  // Feature - Data, Variable, Absolute
     0xC0   // End collection
 };
 
@@ -107,14 +200,23 @@ static const ConfigurationDescriptor KEYBOARD_CONFIG_DESCRIPTOR PROGMEM = {
     .descriptor_type = 2,
     .total_length = (
 	sizeof(ConfigurationDescriptor)
+	// Keyboard
+	+ sizeof(InterfaceDescriptor)
+	+ sizeof(EndpointDescriptor)
+	+ sizeof(HIDDescriptor)
+	// Vendor
+	+ sizeof(InterfaceDescriptor)
+	+ 2 * sizeof(EndpointDescriptor)
+	+ sizeof(HIDDescriptor)
+	// Player 2 keyboard, or the joystick in its place
 	+ sizeof(InterfaceDescriptor)
 	+ sizeof(EndpointDescriptor)
 	+ sizeof(HIDDescriptor)
     ),
-    .num_interfaces = 1,
+    .num_interfaces = 3,
     .configuration_value = 1,
     .configuration_string_index = 0,
-    .attributes = 0xC0,
+    .attributes = 0xA0,  // Bus powered, remote wakeup
     .max_power = 50,
 };
 
@@ -125,7 +227,7 @@ static const ConfigurationDescriptor* KEYBOARD_CONFIG_DESCRIPTORS[] = {
 static const InterfaceDescriptor KEYBOARD_INTERFACE_DESCRIPTOR PROGMEM = {
     .length = sizeof(InterfaceDescriptor),
     .descriptor_type = 4,
-    .interface_number = 0,
+    .interface_number = KEYBOARD_INTERFACE_NUM,
     .alternate_setting = 0,
     .num_endpoints = 1,
     .interface_class = 0x03, // interface class for HIDdescriptor
@@ -134,21 +236,112 @@ static const InterfaceDescriptor KEYBOARD_INTERFACE_DESCRIPTOR PROGMEM = {
     .interface_string_index = 0,
 };
 
+static const InterfaceDescriptor VENDOR_INTERFACE_DESCRIPTOR PROGMEM = {
+    .length = sizeof(InterfaceDescriptor),
+    .descriptor_type = 4,
+    .interface_number = VENDOR_INTERFACE_NUM,
+    .alternate_setting = 0,
+    .num_endpoints = 2,
+    .interface_class = 0x03,
+    .interface_subclass = 0x00,  // no boot protocol
+    .interface_protocol = 0x00,
+    .interface_string_index = 0,
+};
+
+#if PLAYER_COUNT == 2
+static const InterfaceDescriptor KEYBOARD2_INTERFACE_DESCRIPTOR PROGMEM = {
+    .length = sizeof(InterfaceDescriptor),
+    .descriptor_type = 4,
+    .interface_number = KEYBOARD2_INTERFACE_NUM,
+    .alternate_setting = 0,
+    .num_endpoints = 1,
+    .interface_class = 0x03,
+    .interface_subclass = 0x01,
+    .interface_protocol = 0x01,
+    .interface_string_index = 0,
+};
+#else
+static const InterfaceDescriptor JOYSTICK_INTERFACE_DESCRIPTOR PROGMEM = {
+    .length = sizeof(InterfaceDescriptor),
+    .descriptor_type = 4,
+    .interface_number = JOYSTICK_INTERFACE_NUM,
+    .alternate_setting = 0,
+    .num_endpoints = 1,
+    .interface_class = 0x03,
+    .interface_subclass = 0x00,  // no boot protocol
+    .interface_protocol = 0x00,
+    .interface_string_index = 0,
+};
+#endif
+
 static const InterfaceDescriptor* KEYBOARD_INTERFACE_DESCRIPTORS[] = {
     &KEYBOARD_INTERFACE_DESCRIPTOR,
+    &VENDOR_INTERFACE_DESCRIPTOR,
+#if PLAYER_COUNT == 2
+    &KEYBOARD2_INTERFACE_DESCRIPTOR,
+#else
+    &JOYSTICK_INTERFACE_DESCRIPTOR,
+#endif
 };
 
 static const EndpointDescriptor KEYBOARD_ENDPOINT_DESCRIPTOR PROGMEM = {
     .length = sizeof(EndpointDescriptor),
     .descriptor_type = 0x05,
-    .endpoint_address = 0x03 | 0x80,
+    .endpoint_address = KEYBOARD_ENDPOINT_NUM | 0x80,
     .attributes = 0x03,
-    .max_packet_size = 8,
+    .max_packet_size = KEYBOARD_REPORT_SIZE,
     .interval = 0x01
 };
 
+// Telemetry is polled far less often than the keyboard so it never
+// crowds the 1 ms input reports out of a frame.
+static const EndpointDescriptor VENDOR_IN_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = VENDOR_IN_ENDPOINT_NUM | 0x80,
+    .attributes = 0x03,
+    .max_packet_size = VENDOR_REPORT_SIZE,
+    .interval = 0x0A
+};
+
+static const EndpointDescriptor VENDOR_OUT_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = VENDOR_OUT_ENDPOINT_NUM,
+    .attributes = 0x03,
+    .max_packet_size = VENDOR_REPORT_SIZE,
+    .interval = 0x0A
+};
+
+#if PLAYER_COUNT == 2
+static const EndpointDescriptor KEYBOARD2_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = KEYBOARD2_ENDPOINT_NUM | 0x80,
+    .attributes = 0x03,
+    .max_packet_size = KEYBOARD_REPORT_SIZE,
+    .interval = 0x01
+};
+#else
+static const EndpointDescriptor JOYSTICK_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = JOYSTICK_ENDPOINT_NUM | 0x80,
+    .attributes = 0x03,
+    .max_packet_size = JOYSTICK_REPORT_SIZE,
+    .interval = 0x01
+};
+#endif
+
 static const EndpointDescriptor* KEYBOARD_ENDPOINT_DESCRIPTORS[] = {
     &KEYBOARD_ENDPOINT_DESCRIPTOR,
+    &VENDOR_IN_ENDPOINT_DESCRIPTOR,
+    &VENDOR_OUT_ENDPOINT_DESCRIPTOR,
+#if PLAYER_COUNT == 2
+    &KEYBOARD2_ENDPOINT_DESCRIPTOR,
+#else
+    &JOYSTICK_ENDPOINT_DESCRIPTOR,
+#endif
 };
 
 static const HIDDescriptor KEYBOARD_HID_DESCRIPTOR PROGMEM = {
@@ -161,37 +354,214 @@ static const HIDDescriptor KEYBOARD_HID_DESCRIPTOR PROGMEM = {
     .child_descriptor_length = sizeof(keyboard_report_descriptor),
 };
 
-static const HIDDescriptor* KEYBOARD_HID_DESCRIPTORS[] = {
-    &KEYBOARD_HID_DESCRIPTOR,
+static const HIDDescriptor VENDOR_HID_DESCRIPTOR PROGMEM = {
+    .length = sizeof(HIDDescriptor),
+    .descriptor_type = 0x21,
+    .hid_version = 0x0111,
+    .country_code = 0,
+    .num_child_descriptors = 1,
+    .child_descriptor_type = 0x22,
+    .child_descriptor_length = sizeof(vendor_report_descriptor),
+};
+
+#if PLAYER_COUNT == 1
+static const HIDDescriptor JOYSTICK_HID_DESCRIPTOR PROGMEM = {
+    .length = sizeof(HIDDescriptor),
+    .descriptor_type = 0x21,
+    .hid_version = 0x0111,
+    .country_code = 0,
+    .num_child_descriptors = 1,
+    .child_descriptor_type = 0x22,
+    .child_descriptor_length = sizeof(joystick_report_descriptor),
+};
+#endif
+
+// Both players' keyboards are the same, so they share the HID and report
+// descriptors.
+static const uint8_t* KEYBOARD_CLASS_DESCRIPTORS[] = {
+    (const uint8_t*)&KEYBOARD_HID_DESCRIPTOR,
+    (const uint8_t*)&VENDOR_HID_DESCRIPTOR,
+#if PLAYER_COUNT == 2
+    (const uint8_t*)&KEYBOARD_HID_DESCRIPTOR,
+#else
+    (const uint8_t*)&JOYSTICK_HID_DESCRIPTOR,
+#endif
 };
 
+static const uint8_t* REPORT_DESCRIPTORS[] = {
+    keyboard_report_descriptor,
+    vendor_report_descriptor,
+#if PLAYER_COUNT == 2
+    keyboard_report_descriptor,
+#else
+    joystick_report_descriptor,
+#endif
+};
+
+static const uint8_t REPORT_DESCRIPTOR_LENGTHS[] = {
+    sizeof(keyboard_report_descriptor),
+    sizeof(vendor_report_descriptor),
+#if PLAYER_COUNT == 2
+    sizeof(keyboard_report_descriptor),
+#else
+    sizeof(joystick_report_descriptor),
+#endif
+};
+
+uint8_t read_vendor_feature_report(uint8_t report_id, uint8_t offset, uint8_t* chunk, uint8_t length) {
+    void (*read)(uint8_t offset, uint8_t* chunk, uint8_t length);
+    uint8_t size;
+    switch (report_id) {
+    case VENDOR_REPORT_ID_HEALTH:
+	read = health_read_report;
+	size = HEALTH_REPORT_SIZE;
+	break;
+    case VENDOR_REPORT_ID_HISTORY:
+	read = history_read_report;
+	size = HISTORY_REPORT_SIZE;
+	break;
+    default:
+	return 0;
+    }
+
+    // The ID comes first, then the report itself.
+    if (length > 0 && offset == 0) {
+	*chunk++ = report_id;
+	length--;
+    } else if (offset > 0) {
+	offset--;
+    }
+    if (length > 0) {
+	read(offset, chunk, length);
+    }
+    return 1 + size;
+}
+
 static const usb_config_t USB_CONFIG = {
     .device_descriptor = &KEYBOARD_DEVICE_DESCRIPTOR,
     .configuration_descriptors = KEYBOARD_CONFIG_DESCRIPTORS,
     .interface_descriptors = KEYBOARD_INTERFACE_DESCRIPTORS,
+    .class_descriptors = KEYBOARD_CLASS_DESCRIPTORS,
+    .report_descriptors = REPORT_DESCRIPTORS,
+    .report_descriptor_lengths = REPORT_DESCRIPTOR_LENGTHS,
     .endpoint_descriptors = KEYBOARD_ENDPOINT_DESCRIPTORS,
-    .hid_descriptors = KEYBOARD_HID_DESCRIPTORS,
+    .read_vendor_feature_report = read_vendor_feature_report,
+};
+
+// XInput personality, enumerating like a wired Xbox 360 controller so hosts
+// bind their XInput driver to it. Only the gamepad interface of the real
+// controller is there, which is all XInput reads from.
+static const DeviceDescriptor XINPUT_DEVICE_DESCRIPTOR PROGMEM = {
+    .length = sizeof(DeviceDescriptor),
+    .descriptor_type = 1,
+    .usb_version = 0x0200,
+    .device_class = 0xFF,
+    .device_subclass = 0xFF,
+    .device_protocol = 0xFF,
+    .max_packet_size = 32,
+    .vendor_id = 0x045E,   // Microsoft
+    .product_id = 0x028E,  // Xbox 360 Controller
+    .device_version = 0x0114,
+    .manufacturer_string_index = 0,
+    .product_string_index = 0,
+    .serial_number_string_index = 0,
+    .num_configurations = 1,
+};
+
+// Not a HID descriptor despite the type, the XInput driver reads the
+// endpoints and report sizes out of it.
+static const uint8_t XINPUT_CLASS_DESCRIPTOR[] PROGMEM = {
+    0x11,  // Length
+    0x21,  // Type
+    0x00,
+    0x01,
+    0x01,
+    0x25,
+    XINPUT_IN_ENDPOINT_NUM | 0x80,
+    XINPUT_REPORT_SIZE,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x13,
+    XINPUT_OUT_ENDPOINT_NUM,
+    0x08,  // Largest command the host sends
+    0x00,
+    0x00,
+};
+
+static const ConfigurationDescriptor XINPUT_CONFIG_DESCRIPTOR PROGMEM = {
+    .length = sizeof(ConfigurationDescriptor),
+    .descriptor_type = 2,
+    .total_length = (
+	sizeof(ConfigurationDescriptor)
+	+ sizeof(InterfaceDescriptor)
+	+ sizeof(XINPUT_CLASS_DESCRIPTOR)
+	+ 2 * sizeof(EndpointDescriptor)
+    ),
+    .num_interfaces = 1,
+    .configuration_value = 1,
+    .configuration_string_index = 0,
+    .attributes = 0xA0,  // Bus powered, remote wakeup
+    .max_power = 50,
+};
 
-    .report_descriptor = keyboard_report_descriptor,
-    .report_descriptor_length = sizeof(keyboard_report_descriptor),
+static const ConfigurationDescriptor* XINPUT_CONFIG_DESCRIPTORS[] = {
+    &XINPUT_CONFIG_DESCRIPTOR,
 };
 
-typedef struct {
-    pin_t pin;
-    uint8_t scancode;
-} PinButton;
+static const InterfaceDescriptor XINPUT_INTERFACE_DESCRIPTOR PROGMEM = {
+    .length = sizeof(InterfaceDescriptor),
+    .descriptor_type = 4,
+    .interface_number = XINPUT_INTERFACE_NUM,
+    .alternate_setting = 0,
+    .num_endpoints = 2,
+    .interface_class = 0xFF,
+    .interface_subclass = 0x5D,  // XInput gamepad
+    .interface_protocol = 0x01,
+    .interface_string_index = 0,
+};
 
-static PinButton buttons[BUTTON_COUNT] = {
-    {PIN_D2, KEY_A},
-    {PIN_D3, KEY_S},
-    {PIN_D4, KEY_D},
-    {PIN_D6, KEY_W},
-    {PIN_D7, KEY_J},
-    {PIN_D8, KEY_K},
-    {PIN_D9, KEY_L},
-    {PIN_D16, KEY_U},
-    {PIN_D14, KEY_I},
-    {PIN_D15, KEY_O},
+static const InterfaceDescriptor* XINPUT_INTERFACE_DESCRIPTORS[] = {
+    &XINPUT_INTERFACE_DESCRIPTOR,
+};
+
+static const uint8_t* XINPUT_CLASS_DESCRIPTORS[] = {
+    XINPUT_CLASS_DESCRIPTOR,
+};
+
+static const EndpointDescriptor XINPUT_IN_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = XINPUT_IN_ENDPOINT_NUM | 0x80,
+    .attributes = 0x03,
+    .max_packet_size = KEYBOARD_REPORT_SIZE,
+    .interval = 0x01
+};
+
+static const EndpointDescriptor XINPUT_OUT_ENDPOINT_DESCRIPTOR PROGMEM = {
+    .length = sizeof(EndpointDescriptor),
+    .descriptor_type = 0x05,
+    .endpoint_address = XINPUT_OUT_ENDPOINT_NUM,
+    .attributes = 0x03,
+    .max_packet_size = VENDOR_REPORT_SIZE,
+    .interval = 0x08
+};
+
+static const EndpointDescriptor* XINPUT_ENDPOINT_DESCRIPTORS[] = {
+    &XINPUT_IN_ENDPOINT_DESCRIPTOR,
+    &XINPUT_OUT_ENDPOINT_DESCRIPTOR,
+};
+
+static const usb_config_t XINPUT_USB_CONFIG = {
+    .device_descriptor = &XINPUT_DEVICE_DESCRIPTOR,
+    .configuration_descriptors = XINPUT_CONFIG_DESCRIPTORS,
+    .interface_descriptors = XINPUT_INTERFACE_DESCRIPTORS,
+    .class_descriptors = XINPUT_CLASS_DESCRIPTORS,
+    .report_descriptors = NULL,
+    .report_descriptor_lengths = NULL,
+    .endpoint_descriptors = XINPUT_ENDPOINT_DESCRIPTORS,
+    .read_vendor_feature_report = read_vendor_feature_report,
 };
 
 void turn_on_leds() {
@@ -204,52 +574,193 @@ void turn_off_leds() {
   PORTD |= (1 << PD5);
 }
 
-int main(int argc, char** argv) {
-    usb_init(&USB_CONFIG);
+// The LED port writes only happen when the state changes.
+static bool leds_on = false;
 
-    // Set LEDs to output.
-    DDRB |= (1 << PB0);
-    DDRD |= (1 << PD5);
+void set_leds(bool on) {
+    if (on == leds_on) {
+	return;
+    }
+    leds_on = on;
+    if (on) {
+	turn_on_leds();
+    } else {
+	turn_off_leds();
+    }
+}
 
-    // Set buttons to input.
-    DDRD &= (~(1 << PD0) & ~(1 << PD1) & ~(1 << PD4));
+// Sleeps in power-down for as long as the host keeps the bus suspended.
+// If the host allowed remote wakeup, buttons stay armed as wake sources so a
+// press can ask it to resume. Otherwise a press couldn't do anything, and a
+// held button on a level triggered INT pin would wake us over and over, so
+// only bus activity wakes us.
+void sleep_until_resumed() {
+    set_leds(false);
+    analog_stop();
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
 
-    while (usb_state != USB_STATE_ATTACHED) {
-	turn_off_leds();
-	_delay_ms(100);
-	turn_on_leds();
-	_delay_ms(100);
+    bool waking = false;
+    while (usb_suspended) {
+	if (waking) {
+	    // The PLL is back up, just wait for the host to resume.
+	    continue;
+	}
+
+	// Only the host can change this, and not while the bus is suspended.
+	if (usb_remote_wakeup_enabled) {
+	    enable_wake_on_buttons();
+	}
+	cli();
+	if (usb_suspended) {
+	    sleep_enable();
+	    sei();
+	    sleep_cpu();
+	    sleep_disable();
+	}
+	sei();
+	disable_wake_on_buttons();
+
+	if (scan_buttons() != 0 && usb_remote_wakeup() == 0) {
+	    waking = true;
+	}
     }
+    analog_start();
+}
 
-    PORTD = 0; // push nothing out of port 0 to start with...
-    for (int i = 0; i < BUTTON_COUNT; i++) {
-	set_pull_up(buttons[i].pin);
+// Set once at boot from the chords held at plug-in.
+static bool xinput = false;
+static bool latency_test = false;
+static const report_builder_t* builders = REPORT_BUILDERS;
+
+// The debounced buttons of the last scan.
+static uint16_t pressed = 0;
+
+// The scheduler's strict-priority task, from the pins to the host.
+void scan_task() {
+    if (latency_test) {
+	pressed = latency_test_next_frame();
+    } else {
+	// Only coalescing needs the frame start, and reading it means
+	// turning interrupts off.
+	uint16_t frame_start = COALESCE_WINDOW_US ? usb_frame_start() : 0;
+	pressed = input_process(scan_buttons(), clock_ticks(), frame_start);
     }
 
-    while (true) {
-	bool leds_on = false;
-	for (int i = 0; i < 6; i++) {
-	    keyboard_pressed_keys[i] = 0;
+    // The protocol only changes on SET_PROTOCOL, and the personality
+    // never, so picking the builder by table lookup keeps the loop free
+    // of protocol branches.
+    uint8_t report[KEYBOARD_REPORT_SIZE];
+    for (uint8_t player = 0; player < PLAYER_COUNT; player++) {
+	uint8_t protocol = keyboard_protocols[player];
+	uint8_t length = builders[protocol](report, pressed & player_buttons[player]);
+	if (latency_test) {
+	    latency_test_stamp(report, protocol);
 	}
+	usb_send(player, report, length);
+    }
+    // Only goes anywhere in single player builds, and only on change.
+    usb_send_joystick(report, build_axes_report(report));
+}
 
-	int keyboard_index = 0;
-	for (int i = 0; i < BUTTON_COUNT; i++) {
-	    if (keyboard_index >= 6) {
-		break;
-	    }
-
-	    if (is_pin_low(buttons[i].pin)) {
-		leds_on = true;
-		keyboard_pressed_keys[keyboard_index] = buttons[i].scancode;
-		keyboard_index++;
-	    }
-	}
+#define BLINK_TICKS (100000 / TICK_US)  // 100 ms
+
+// Blinks while the host hasn't configured us yet, then lights up while
+// anything's pressed.
+void led_task() {
+    static uint16_t last_toggle = 0;
+    static bool blink = false;
+
+    if (usb_state == USB_STATE_ATTACHED) {
+	set_leds(pressed != 0);
+	return;
+    }
+    uint16_t now = clock_ticks();
+    if ((uint16_t)(now - last_toggle) >= BLINK_TICKS) {
+	last_toggle = now;
+	blink = !blink;
+    }
+    set_leds(blink);
+}
+
+#define TELEMETRY_PERIOD_TICKS (100000 / TICK_US)  // 100 ms
+
+// Every TELEMETRY_PERIOD_TICKS the scheduler's stats go out as telemetry,
+// little endian words:
+//
+//   passes         main loop passes in the period
+//   longest scan   in ticks
+//   longest pass   scan and background together, in ticks
+//   tick           in us
+//
+// They're dropped when the host isn't reading, and the next period starts
+// over.
+void telemetry_task() {
+    static uint16_t period_start = 0;
+
+    uint16_t now = clock_ticks();
+    if ((uint16_t)(now - period_start) < TELEMETRY_PERIOD_TICKS) {
+	return;
+    }
+    period_start = now;
+
+    scheduler_stats_t stats;
+    scheduler_take_stats(&stats);
+    uint8_t data[8] = {
+	stats.passes, stats.passes >> 8,
+	stats.longest_scan, stats.longest_scan >> 8,
+	stats.longest_pass, stats.longest_pass >> 8,
+	TICK_US, 0,
+    };
+    usb_send_telemetry(data, sizeof(data));
+}
+
+// Rumble and LED commands are ignored, but the OUT endpoint still has to
+// be drained for the host's writes to complete.
+void xinput_command_task() {
+    if (xinput) {
+	uint8_t command[8];
+	usb_receive_config(command, sizeof(command));
+    }
+}
+
+static const task_t BACKGROUND_TASKS[] = {
+    led_task,
+    eeprom_queue_task,
+    telemetry_task,
+    xinput_command_task,
+};
 
-	if (leds_on) {
-	    turn_on_leds();
-	} else {
-	    turn_off_leds();
+int main(int argc, char** argv) {
+    // The PLL locks while the pins and the pipeline are set up.
+    usb_power_up();
+
+    PORTD = 0; // push nothing out of port 0 to start with...
+    layout_init();
+    history_init(HISTORY_FREEZE_CHORD);
+    clock_init();
+    scheduler_init(BACKGROUND_TASKS, sizeof(BACKGROUND_TASKS) / sizeof(BACKGROUND_TASKS[0]));
+
+    // Set LEDs to output, starting off.
+    turn_off_leds();
+    DDRB |= (1 << PB0);
+    DDRD |= (1 << PD5);
+
+    // The personality decides the descriptors, so the chords are read before
+    // enumeration. Give the pull-ups a moment to bring the pins up first.
+    _delay_us(10);
+    uint16_t held = scan_buttons();
+    xinput = PLAYER_COUNT == 1 && held == XINPUT_CHORD;
+    latency_test = held == LATENCY_TEST_CHORD;
+    builders = xinput ? XINPUT_REPORT_BUILDERS : REPORT_BUILDERS;
+    usb_init(xinput ? &XINPUT_USB_CONFIG : &USB_CONFIG);
+
+    // Straight into the loop, which scans and debounces while the host
+    // enumerates, so the first report after SET_CONFIGURATION already has
+    // the buttons' settled state in it.
+    while (true) {
+	if (usb_suspended) {
+	    sleep_until_resumed();
 	}
-	usb_send();
+	scheduler_run_pass(scan_task);
     }
 }
@@ -0,0 +1,13 @@
+#pragma once
+
+// Register and flash access for everything on the input path (hal.h,
+// analog.c, clock.h, layout.c). Firmware builds get the real registers,
+// HOST builds get plain variables from host/mock_regs.h so the same sources
+// run natively.
+#ifdef HOST
+#include "host/mock_regs.h"
+#else
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#endif
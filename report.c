@@ -0,0 +1,129 @@
+#include "report.h"
+
+#include <string.h>
+
+#include "keys.h"
+
+#define FIRST_MODIFIER 0xE0
+
+// Boot layout: either a modifier bit or a scancode slot per button.
+static uint8_t boot_modifiers[MAX_BUTTONS];
+static uint8_t boot_scancodes[MAX_BUTTONS];
+
+// NKRO layout: the byte and bit each button sets.
+static uint8_t nkro_offsets[MAX_BUTTONS];
+static uint8_t nkro_masks[MAX_BUTTONS];
+
+// XInput layout: the bits each button sets in the button word, and which
+// buttons pull each trigger.
+static uint16_t xinput_masks[MAX_BUTTONS];
+static uint16_t xinput_left_trigger = 0;
+static uint16_t xinput_right_trigger = 0;
+
+const report_builder_t REPORT_BUILDERS[2] = {
+    build_boot_report,
+    build_nkro_report,
+};
+
+const report_builder_t XINPUT_REPORT_BUILDERS[2] = {
+    build_xinput_report,
+    build_xinput_report,
+};
+
+void report_map_button(uint8_t button, uint8_t scancode) {
+    if (scancode >= FIRST_MODIFIER) {
+	uint8_t modifier = 1 << (scancode - FIRST_MODIFIER);
+	boot_modifiers[button] = modifier;
+	boot_scancodes[button] = KEY_NONE;
+	nkro_offsets[button] = 0;
+	nkro_masks[button] = modifier;
+    } else if (scancode <= NKRO_MAX_USAGE) {
+	boot_modifiers[button] = 0;
+	boot_scancodes[button] = scancode;
+	nkro_offsets[button] = 1 + (scancode >> 3);
+	nkro_masks[button] = 1 << (scancode & 0b111);
+    } else {
+	// Out of range of the bitmap, so report protocol can't send it.
+	boot_modifiers[button] = 0;
+	boot_scancodes[button] = scancode;
+	nkro_offsets[button] = 0;
+	nkro_masks[button] = 0;
+    }
+}
+
+void report_map_xinput(uint8_t button, xinput_button_t xinput) {
+    uint16_t bit = 1U << button;
+    xinput_masks[button] = 0;
+    xinput_left_trigger &= ~bit;
+    xinput_right_trigger &= ~bit;
+
+    if (xinput == XINPUT_LEFT_TRIGGER) {
+	xinput_left_trigger |= bit;
+    } else if (xinput == XINPUT_RIGHT_TRIGGER) {
+	xinput_right_trigger |= bit;
+    } else if (xinput != XINPUT_NONE) {
+	xinput_masks[button] = 1U << xinput;
+    }
+}
+
+uint8_t build_boot_report(uint8_t* report, uint16_t buttons) {
+    memset(report, 0, BOOT_REPORT_SIZE);
+
+    uint8_t key = 2;
+    for (uint8_t i = 0; buttons != 0; i++, buttons >>= 1) {
+	if ((buttons & 1) == 0) {
+	    continue;
+	}
+
+	report[0] |= boot_modifiers[i];
+	if (boot_scancodes[i] == KEY_NONE) {
+	    continue;
+	}
+	if (key == BOOT_REPORT_SIZE) {
+	    // More than 6 keys, so report rollover in every slot like
+	    // the spec asks for.
+	    memset(report + 2, KEY_ERR_OVF, BOOT_REPORT_SIZE - 2);
+	    break;
+	}
+	report[key++] = boot_scancodes[i];
+    }
+    return BOOT_REPORT_SIZE;
+}
+
+uint8_t build_nkro_report(uint8_t* report, uint16_t buttons) {
+    memset(report, 0, NKRO_REPORT_SIZE);
+
+    for (uint8_t i = 0; buttons != 0; i++, buttons >>= 1) {
+	if (buttons & 1) {
+	    report[nkro_offsets[i]] |= nkro_masks[i];
+	}
+    }
+    return NKRO_REPORT_SIZE;
+}
+
+uint8_t build_xinput_report(uint8_t* report, uint16_t buttons) {
+    memset(report, 0, XINPUT_REPORT_SIZE);
+    report[0] = 0x00;  // Input report
+    report[1] = XINPUT_REPORT_SIZE;
+
+    // Digital triggers, fully pulled or not at all.
+    report[XINPUT_LEFT_TRIGGER_OFFSET] = (buttons & xinput_left_trigger) ? 0xFF : 0;
+    report[XINPUT_RIGHT_TRIGGER_OFFSET] = (buttons & xinput_right_trigger) ? 0xFF : 0;
+
+    uint16_t xinput = 0;
+    for (uint8_t i = 0; buttons != 0; i++, buttons >>= 1) {
+	if (buttons & 1) {
+	    xinput |= xinput_masks[i];
+	}
+    }
+    report[XINPUT_BUTTONS_OFFSET] = xinput;
+    report[XINPUT_BUTTONS_OFFSET + 1] = xinput >> 8;
+    return XINPUT_REPORT_SIZE;
+}
+
+uint8_t build_axes_report(uint8_t* report) {
+    for (uint8_t i = 0; i < ANALOG_AXIS_COUNT; i++) {
+	report[i] = analog_axes[i];
+    }
+    return AXES_REPORT_SIZE;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "analog.h"
+#include "usb.h"
+
+// Boot protocol: modifier byte, reserved byte, 6 scancodes. Hosts that ask
+// for boot protocol ignore the report descriptor and assume this layout.
+#define BOOT_REPORT_SIZE 8
+
+// Report protocol: modifier byte followed by one bit per usage from 0x00 to
+// NKRO_MAX_USAGE, so every button can be held at once, then a reserved byte
+// like the boot layout's.
+#define NKRO_BITMAP_SIZE 15
+#define NKRO_MAX_USAGE (8 * NKRO_BITMAP_SIZE - 1)
+#define NKRO_RESERVED_OFFSET (1 + NKRO_BITMAP_SIZE)
+#define NKRO_REPORT_SIZE (NKRO_RESERVED_OFFSET + 1)
+
+_Static_assert(NKRO_REPORT_SIZE <= KEYBOARD_REPORT_SIZE, "NKRO report doesn't fit the keyboard endpoint");
+
+// Joystick: one byte per analog axis.
+#define AXES_REPORT_SIZE ANALOG_AXIS_COUNT
+
+_Static_assert(AXES_REPORT_SIZE <= JOYSTICK_REPORT_SIZE, "Axes report doesn't fit the joystick endpoint");
+
+// XInput (Xbox 360 controller): message type, message length, the button
+// bits, both triggers, both sticks, then padding.
+#define XINPUT_REPORT_SIZE 20
+#define XINPUT_BUTTONS_OFFSET 2
+#define XINPUT_LEFT_TRIGGER_OFFSET 4
+#define XINPUT_RIGHT_TRIGGER_OFFSET 5
+
+// What a button does in XInput: a bit of the button word, or a trigger.
+typedef enum {
+    XINPUT_DPAD_UP,
+    XINPUT_DPAD_DOWN,
+    XINPUT_DPAD_LEFT,
+    XINPUT_DPAD_RIGHT,
+    XINPUT_START,
+    XINPUT_BACK,
+    XINPUT_LEFT_THUMB,
+    XINPUT_RIGHT_THUMB,
+    XINPUT_LEFT_SHOULDER,
+    XINPUT_RIGHT_SHOULDER,
+    XINPUT_GUIDE,
+    XINPUT_A = 12,
+    XINPUT_B,
+    XINPUT_X,
+    XINPUT_Y,
+    XINPUT_LEFT_TRIGGER,
+    XINPUT_RIGHT_TRIGGER,
+    XINPUT_NONE,
+} xinput_button_t;
+
+#define MAX_BUTTONS 16
+
+// Writes the report for the packed button word (bit i = button i pressed)
+// and returns its length.
+typedef uint8_t (*report_builder_t)(uint8_t* report, uint16_t buttons);
+
+// Indexed by the HID protocol the host selected, 0 = boot, 1 = report.
+extern const report_builder_t REPORT_BUILDERS[2];
+
+// The same shape for the XInput personality, which has no boot protocol.
+extern const report_builder_t XINPUT_REPORT_BUILDERS[2];
+
+// Precomputes where button's scancode lands in both report layouts. Must be
+// called for every button before any report is built.
+void report_map_button(uint8_t button, uint8_t scancode);
+
+// Same for the XInput layout, buttons that aren't mapped do nothing there.
+void report_map_xinput(uint8_t button, xinput_button_t xinput);
+
+uint8_t build_boot_report(uint8_t* report, uint16_t buttons);
+uint8_t build_nkro_report(uint8_t* report, uint16_t buttons);
+uint8_t build_xinput_report(uint8_t* report, uint16_t buttons);
+
+// The analog axes as they stand, for the joystick interface.
+uint8_t build_axes_report(uint8_t* report);
@@ -0,0 +1,46 @@
+#include "scheduler.h"
+
+static const task_t* tasks = 0;
+static uint8_t task_count = 0;
+static uint8_t next_task = 0;
+
+static scheduler_stats_t stats = {0};
+
+void scheduler_init(const task_t* background, uint8_t count) {
+    tasks = background;
+    task_count = count;
+    next_task = 0;
+}
+
+void scheduler_run_pass(task_t scan) {
+    uint16_t pass_start = clock_ticks();
+    scan();
+    uint16_t slice_start = clock_ticks();
+
+    // At most one round, a task that's got more to do picks it up on its
+    // next turn.
+    for (uint8_t i = 0; i < task_count; i++) {
+	tasks[next_task]();
+	next_task = next_task + 1 == task_count ? 0 : next_task + 1;
+	if ((uint16_t)(clock_ticks() - slice_start) >= BACKGROUND_SLICE_TICKS) {
+	    break;
+	}
+    }
+
+    uint16_t scan_ticks = slice_start - pass_start;
+    uint16_t pass_ticks = clock_ticks() - pass_start;
+    if (stats.passes < UINT16_MAX) {
+	stats.passes++;
+    }
+    if (scan_ticks > stats.longest_scan) {
+	stats.longest_scan = scan_ticks;
+    }
+    if (pass_ticks > stats.longest_pass) {
+	stats.longest_pass = pass_ticks;
+    }
+}
+
+void scheduler_take_stats(scheduler_stats_t* taken) {
+    *taken = stats;
+    stats = (scheduler_stats_t){0};
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "clock.h"
+
+// Cooperative scheduling for the main loop. Every pass runs the scan task
+// first, then background tasks take turns for what's left of a slice of
+// BACKGROUND_SLICE_TICKS. Each background task does one bounded step per
+// call and returns, so a pass never runs over the slice by more than one
+// step and the scan rate stays put whatever the background has queued.
+#define BACKGROUND_SLICE_TICKS (40 / TICK_US)  // 40 us
+
+typedef void (*task_t)();
+
+// The background tasks, in the order they take turns. Every pass runs at
+// least one of them, so none of them starves.
+void scheduler_init(const task_t* background, uint8_t count);
+
+// One pass of the main loop.
+void scheduler_run_pass(task_t scan);
+
+// Passes since the last call, and the longest scan and whole pass among
+// them in ticks.
+typedef struct {
+    uint16_t passes;
+    uint16_t longest_scan;
+    uint16_t longest_pass;
+} scheduler_stats_t;
+
+void scheduler_take_stats(scheduler_stats_t* stats);
@@ -1,33 +1,849 @@
 #include <libgen.h>
 #include <pthread.h>
+#include <simavr/avr_ioport.h>
 #include <simavr/avr_twi.h>
+#include <simavr/avr_usb.h>
 #include <simavr/parts/i2c_eeprom.h>
 #include <simavr/sim_avr.h>
 #include <simavr/sim_elf.h>
 #include <simavr/sim_gdb.h>
 #include <simavr/sim_vcd_file.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FREQUENCY 16000000
+
+// ATmega32u4 registers and vectors the host emulator pokes at directly,
+// because simavr's USB controller doesn't model bus suspend or resume.
+#define UDCON 0xE0
+#define UDINT 0xE1
+#define UDIEN 0xE2
+#define RMWKUP 1
+#define SUSPI 0
+#define WAKEUPI 4
+#define USB_GEN_VECTOR 10
+
+#define EP0_SIZE 32
+#define KEYBOARD_ENDPOINT_NUM 3
+
+// Time the host leaves between control transfer stages, and how many times
+// it retries a NAKed stage before giving up.
+#define CONTROL_TURNAROUND_USEC 100
+#define CONTROL_RETRIES 100
+
+// Resume has to be answered with a report within this budget.
+#define RESUME_BUDGET_USEC 3000
+
+// How far a cycle or size metric may grow past its baseline before the
+// cycles scenario fails.
+#define REGRESSION_TOLERANCE_PERCENT 2
+
+// ATmega32u4 with the Caterina bootloader taking the top 4 KB of flash.
+#define FLASH_BUDGET 28672
+#define RAM_BUDGET 2560
+
+#define SPL 0x5D
+#define SPH 0x5E
 
 avr_t* avr = NULL;
 avr_vcd_t vcd_file;
 i2c_eeprom_t eeprom;
 
-int main(int argc, char *argv[]) {
-    elf_firmware_t firmware;
-    if (elf_read_firmware("target/fightstick.elf", &firmware) < 0) {
-	fprintf(stderr, "Failed to run elf_read_firmware");
-	return 1;
+typedef struct {
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+} usb_setup_t;
+
+// State of the emulated host. Once the device is configured the host polls
+// the keyboard endpoint every poll_interval_usec, like a real host does
+// once per frame.
+typedef struct {
+    bool attached;
+    bool configured;
+    bool suspended;
+    uint32_t poll_interval_usec;
+    avr_cycle_count_t next_poll_cycle;
+
+    uint8_t report[64];
+    uint32_t report_length;
+    uint64_t reports_received;
+    avr_cycle_count_t first_report_cycle;
+    avr_cycle_count_t last_report_cycle;
+} host_t;
+
+static host_t host = {
+    .poll_interval_usec = 1000,
+};
+
+// Cycle counting for one firmware function. A call starts when the PC hits
+// the symbol's address and ends when the stack pointer climbs back above
+// where it was at that point, i.e. on the matching ret/reti.
+//
+// With per_call unset the probe instead measures from one call to the next,
+// which is how a main loop iteration is counted.
+typedef struct {
+    const char* name;
+    const char* symbol;
+    bool per_call;
+
+    uint32_t address;
+    bool active;
+    uint16_t entry_sp;
+    avr_cycle_count_t entry_cycle;
+
+    uint64_t calls;
+    avr_cycle_count_t total;
+    avr_cycle_count_t max;
+} probe_t;
+
+static probe_t probes[] = {
+    {"main_loop", "scan_buttons", false},
+    {"usb_send", "usb_send", true},
+    {"usb_gen_isr", "__vector_10", true},  // ISR(USB_GEN_vect)
+    {"usb_com_isr", "__vector_11", true},  // ISR(USB_COM_vect)
+};
+
+#define PROBE_COUNT (sizeof(probes) / sizeof(probes[0]))
+
+static bool probing = false;
+
+static elf_firmware_t firmware;
+
+avr_cycle_count_t usec_to_cycles(uint64_t usec) {
+    return usec * (FREQUENCY / 1000000);
+}
+
+double cycles_to_ms(avr_cycle_count_t cycles) {
+    return (double)cycles * 1000 / FREQUENCY;
+}
+
+void attach_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+    host.attached = value != 0;
+}
+
+void raise_usb_general_interrupt(uint8_t flag) {
+    if (!(avr->data[UDIEN] & (1 << flag))) {
+	return;  // The firmware isn't listening for it
+    }
+    avr->data[UDINT] |= (1 << flag);
+    for (int i = 0; i < avr->interrupts.vector_count; i++) {
+	if (avr->interrupts.vector[i]->vector == USB_GEN_VECTOR) {
+	    avr_raise_interrupt(avr, avr->interrupts.vector[i]);
+	}
     }
+}
 
-    avr = avr_make_mcu_by_name(firmware.mmcu);
-    avr_init(avr);
-    avr_load_firmware(avr, &firmware);
+void poll_keyboard_endpoint() {
+    uint8_t buffer[64];
+    struct avr_io_usb packet = {
+	.pipe = KEYBOARD_ENDPOINT_NUM,
+	.sz = sizeof(buffer),
+	.buf = buffer,
+    };
+    if (avr_ioctl(avr, AVR_IOCTL_USB_READ, &packet) != 0 || packet.sz == 0) {
+	return;
+    }
+
+    memcpy(host.report, buffer, packet.sz);
+    host.report_length = packet.sz;
+    if (host.reports_received++ == 0) {
+	host.first_report_cycle = avr->cycle;
+    }
+    host.last_report_cycle = avr->cycle;
+}
+
+uint16_t stack_pointer() {
+    return avr->data[SPL] | (avr->data[SPH] << 8);
+}
+
+void record_probe(probe_t* probe, avr_cycle_count_t cycles) {
+    probe->calls++;
+    probe->total += cycles;
+    if (cycles > probe->max) {
+	probe->max = cycles;
+    }
+}
+
+void service_probes() {
+    uint16_t sp = stack_pointer();
+    for (size_t i = 0; i < PROBE_COUNT; i++) {
+	probe_t* probe = &probes[i];
+	if (probe->per_call && probe->active && sp > probe->entry_sp) {
+	    probe->active = false;
+	    record_probe(probe, avr->cycle - probe->entry_cycle);
+	}
+	if (avr->pc != probe->address || probe->address == 0) {
+	    continue;
+	}
 
+	if (!probe->per_call && probe->active) {
+	    record_probe(probe, avr->cycle - probe->entry_cycle);
+	}
+	if (!probe->per_call || !probe->active) {
+	    probe->active = true;
+	    probe->entry_sp = sp;
+	    probe->entry_cycle = avr->cycle;
+	}
+    }
+}
+
+int find_probe_addresses() {
+    for (size_t i = 0; i < PROBE_COUNT; i++) {
+	for (uint32_t j = 0; j < firmware.symbolcount; j++) {
+	    if (strcmp(firmware.symbol[j]->symbol, probes[i].symbol) == 0) {
+		probes[i].address = firmware.symbol[j]->addr;
+	    }
+	}
+	if (probes[i].address == 0) {
+	    fprintf(stderr, "No symbol %s in the firmware\n", probes[i].symbol);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// Everything the host does between two instructions of the firmware.
+void service_host() {
+    if (host.suspended && (avr->data[UDCON] & (1 << RMWKUP)) && (avr->data[UDINT] & (1 << SUSPI))) {
+	// The device is signalling remote wakeup, which the hardware only
+	// does while SUSPI is still set, and clears RMWKUP once it's done.
+	// Answer with resume signalling of our own.
+	avr->data[UDCON] &= ~(1 << RMWKUP);
+	host.suspended = false;
+	raise_usb_general_interrupt(WAKEUPI);
+    }
+
+    if (!host.configured || host.suspended || avr->cycle < host.next_poll_cycle) {
+	return;
+    }
+    host.next_poll_cycle = avr->cycle + usec_to_cycles(host.poll_interval_usec);
+    poll_keyboard_endpoint();
+}
+
+void step() {
+    int state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+	fprintf(stderr, "Firmware stopped running\n");
+	exit(1);
+    }
+    if (probing) {
+	service_probes();
+    }
+    service_host();
+}
+
+void run_for_usec(uint64_t usec) {
+    avr_cycle_count_t end = avr->cycle + usec_to_cycles(usec);
+    while (avr->cycle < end) {
+	step();
+    }
+}
+
+int retry_ioctl(uint32_t ioctl, struct avr_io_usb* packet) {
+    uint32_t size = packet->sz;
+    for (int i = 0; i < CONTROL_RETRIES; i++) {
+	packet->sz = size;
+	int ret = avr_ioctl(avr, ioctl, packet);
+	if (ret != AVR_IOCTL_USB_NAK) {
+	    return ret;
+	}
+	run_for_usec(CONTROL_TURNAROUND_USEC);
+    }
+    return AVR_IOCTL_USB_NAK;
+}
+
+// simavr's NAK and STALL codes are ioctl numbers, not negative errors.
+bool usb_failed(int ret) {
+    return ret == AVR_IOCTL_USB_NAK || ret == AVR_IOCTL_USB_STALL;
+}
+
+// Runs a whole control transfer on EP0 and returns the number of bytes
+// received in the data stage, or -1 when a stage was stalled or never
+// answered.
+int control_transfer(usb_setup_t setup, uint8_t* data) {
+    struct avr_io_usb packet = {
+	.pipe = 0,
+	.sz = sizeof(setup),
+	.buf = (uint8_t*)&setup,
+    };
+    if (usb_failed(avr_ioctl(avr, AVR_IOCTL_USB_SETUP, &packet))) {
+	return -1;
+    }
+    run_for_usec(CONTROL_TURNAROUND_USEC);
+
+    uint8_t buffer[EP0_SIZE];
+    int received = 0;
+    int ret;
+    if (setup.request_type & 0x80) {
+	// IN data stage until a short packet, then a zero length OUT status.
+	while (received < setup.length) {
+	    packet.buf = buffer;
+	    packet.sz = sizeof(buffer);
+	    if (usb_failed(retry_ioctl(AVR_IOCTL_USB_READ, &packet))) {
+		return -1;
+	    }
+	    memcpy(data + received, buffer, packet.sz);
+	    received += packet.sz;
+	    if (packet.sz < EP0_SIZE) {
+		break;
+	    }
+	}
+	packet.buf = buffer;
+	packet.sz = 0;
+	ret = retry_ioctl(AVR_IOCTL_USB_WRITE, &packet);
+    } else {
+	// None of our OUT requests have a data stage, so straight to the
+	// zero length IN status.
+	packet.buf = buffer;
+	packet.sz = sizeof(buffer);
+	ret = retry_ioctl(AVR_IOCTL_USB_READ, &packet);
+    }
+    return usb_failed(ret) ? -1 : received;
+}
+
+// Takes the device from power-on to configured, the way Linux does it.
+int enumerate() {
+    for (int i = 0; i < 1000 && !host.attached; i++) {
+	run_for_usec(100);
+    }
+    if (!host.attached) {
+	fprintf(stderr, "Device never attached\n");
+	return -1;
+    }
+
+    avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+    run_for_usec(1000);
+
+    uint8_t data[256];
+    if (control_transfer((usb_setup_t){0x80, 0x06, 0x0100, 0, 18}, data) < 18) {
+	fprintf(stderr, "GET_DESCRIPTOR(device) failed\n");
+	return -1;
+    }
+    if (control_transfer((usb_setup_t){0x00, 0x05, 1, 0, 0}, data) < 0) {
+	fprintf(stderr, "SET_ADDRESS failed\n");
+	return -1;
+    }
+    if (control_transfer((usb_setup_t){0x80, 0x06, 0x0200, 0, 9}, data) < 9) {
+	fprintf(stderr, "GET_DESCRIPTOR(configuration) failed\n");
+	return -1;
+    }
+    uint16_t total_length = data[2] | (data[3] << 8);
+    uint8_t num_interfaces = data[4];
+    if (control_transfer((usb_setup_t){0x80, 0x06, 0x0200, 0, total_length}, data) < total_length) {
+	fprintf(stderr, "GET_DESCRIPTOR(configuration) failed\n");
+	return -1;
+    }
+    if (control_transfer((usb_setup_t){0x00, 0x09, 1, 0, 0}, data) < 0) {
+	fprintf(stderr, "SET_CONFIGURATION failed\n");
+	return -1;
+    }
+    host.configured = true;
+    host.next_poll_cycle = avr->cycle;
+
+    for (uint16_t interface = 0; interface < num_interfaces; interface++) {
+	control_transfer((usb_setup_t){0x21, 0x0A, 0, interface, 0}, data);
+	control_transfer((usb_setup_t){0x81, 0x06, 0x2200, interface, sizeof(data)}, data);
+    }
+    return 0;
+}
+
+void suspend_bus() {
+    host.suspended = true;
+    raise_usb_general_interrupt(SUSPI);
+}
+
+void resume_bus() {
+    host.suspended = false;
+    raise_usb_general_interrupt(WAKEUPI);
+}
+
+void set_button(char port, int pin, bool pressed) {
+    // Buttons short the pulled-up pin to ground.
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), pin), !pressed);
+}
+
+// Cycles from now until the host receives its next report, polling fine
+// grained so the measurement isn't quantized to a frame.
+avr_cycle_count_t measure_next_report(uint32_t timeout_usec) {
+    uint32_t poll_interval_usec = host.poll_interval_usec;
+    host.poll_interval_usec = 10;
+    host.next_poll_cycle = avr->cycle;
+
+    avr_cycle_count_t start = avr->cycle;
+    uint64_t reports = host.reports_received;
+    avr_cycle_count_t end = start + usec_to_cycles(timeout_usec);
+    while (host.reports_received == reports && avr->cycle < end) {
+	step();
+    }
+
+    host.poll_interval_usec = poll_interval_usec;
+    if (host.reports_received == reports) {
+	return 0;
+    }
+    return host.last_report_cycle - start;
+}
+
+int scenario_run() {
     int state = cpu_Running;
     while (state != cpu_Done && state != cpu_Crashed) {
 	state = avr_run(avr);
     }
+    return 0;
+}
+
+int check_resume_latency(const char* name, avr_cycle_count_t latency) {
+    if (latency == 0) {
+	printf("%s: no report\n", name);
+	return 1;
+    }
+    printf("%s: %.3f ms\n", name, cycles_to_ms(latency));
+    return latency > usec_to_cycles(RESUME_BUDGET_USEC);
+}
+
+// Suspends the configured device and measures how long it takes to get a
+// report back to the host, once for host initiated resume and once for
+// remote wakeup from a button press.
+int scenario_resume() {
+    if (enumerate() < 0) {
+	return 1;
+    }
+    run_for_usec(10000);
+
+    int failures = 0;
+    suspend_bus();
+    run_for_usec(10000);
+    // Enumeration set the idle rate to 0, so only a change gets a report
+    // out. Press as soon as the host resumes.
+    resume_bus();
+    set_button('B', 4, true);
+    failures += check_resume_latency("resume-to-first-report", measure_next_report(10 * RESUME_BUDGET_USEC));
+    set_button('B', 4, false);
+    run_for_usec(10000);
+
+    uint8_t data[1];
+    control_transfer((usb_setup_t){0x00, 0x03, 1, 0, 0}, data);  // SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+    suspend_bus();
+    run_for_usec(10000);
+    set_button('B', 4, true);
+    failures += check_resume_latency("press-to-first-report", measure_next_report(10 * RESUME_BUDGET_USEC));
+    set_button('B', 4, false);
+
+    return failures != 0;
+}
+
+typedef struct {
+    char name[32];
+    uint64_t value;
+} metric_t;
+
+#define MAX_METRICS 32
+
+static metric_t metrics[MAX_METRICS];
+static int metric_count = 0;
+
+// Where the cycles scenario compares against, or records, its metrics.
+static const char* baseline_path = NULL;
+static const char* record_path = NULL;
+
+void add_metric(const char* name, const char* suffix, uint64_t value) {
+    metric_t* metric = &metrics[metric_count++];
+    snprintf(metric->name, sizeof(metric->name), "%s%s", name, suffix);
+    metric->value = value;
+    printf("%-20s %10llu\n", metric->name, (unsigned long long)value);
+}
+
+int record_metrics(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+	fprintf(stderr, "Failed to open %s\n", path);
+	return 1;
+    }
+    for (int i = 0; i < metric_count; i++) {
+	fprintf(file, "%s %llu\n", metrics[i].name, (unsigned long long)metrics[i].value);
+    }
+    fclose(file);
+    printf("Recorded baseline in %s\n", path);
+    return 0;
+}
+
+int compare_metrics(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+	// Nothing to regress against yet, the budget check above is all there
+	// is.
+	printf("No baseline at %s, nothing compared. Record one with `make cycles-baseline`\n", path);
+	return 0;
+    }
+
+    int regressions = 0;
+    char name[64];
+    unsigned long long baseline;
+    while (fscanf(file, "%63s %llu", name, &baseline) == 2) {
+	for (int i = 0; i < metric_count; i++) {
+	    if (strcmp(metrics[i].name, name) != 0) {
+		continue;
+	    }
+	    uint64_t limit = baseline + baseline * REGRESSION_TOLERANCE_PERCENT / 100;
+	    if (metrics[i].value > limit) {
+		printf("REGRESSION %s: %llu, baseline %llu\n", name, (unsigned long long)metrics[i].value, baseline);
+		regressions++;
+	    }
+	}
+    }
+    fclose(file);
+    return regressions != 0;
+}
+
+// Pins of the direct-wired layout in layout.c, pressed in turn so the
+// whole input path gets exercised.
+static const struct {
+    char port;
+    int pin;
+} BUTTON_PINS[] = {
+    {'D', 1}, {'D', 0}, {'D', 4}, {'D', 7}, {'E', 6},
+    {'B', 4}, {'B', 5}, {'B', 2}, {'B', 3}, {'B', 1},
+};
+
+#define BUTTON_PIN_COUNT (sizeof(BUTTON_PINS) / sizeof(BUTTON_PINS[0]))
+
+// Counts cycles from power-on to the host's first report, in the main loop,
+// usb_send and both USB interrupts while buttons are pressed and released,
+// plus the flash and RAM footprint, and checks them against a stored
+// baseline.
+int scenario_cycles() {
+    if (find_probe_addresses() < 0) {
+	return 1;
+    }
+
+    // A button held from power-on, so the first report has something in it
+    // and goes out as soon as the device is configured.
+    set_button(BUTTON_PINS[5].port, BUTTON_PINS[5].pin, true);
+    if (enumerate() < 0) {
+	return 1;
+    }
+    for (int i = 0; i < 100 && host.reports_received == 0; i++) {
+	run_for_usec(100);
+    }
+    if (host.reports_received == 0) {
+	printf("No report after enumeration\n");
+	return 1;
+    }
+    add_metric("boot_to_first_report", "", host.first_report_cycle);
+    set_button(BUTTON_PINS[5].port, BUTTON_PINS[5].pin, false);
+    run_for_usec(10000);
+
+    // Drain the keyboard endpoint as soon as a report lands, so usb_send
+    // never waits on a bank and only the firmware's own work is counted.
+    host.poll_interval_usec = 0;
+    probing = true;
+    for (int i = 0; i < 200; i++) {
+	set_button(BUTTON_PINS[i % BUTTON_PIN_COUNT].port, BUTTON_PINS[i % BUTTON_PIN_COUNT].pin, (i / BUTTON_PIN_COUNT) % 2 == 0);
+	run_for_usec(1000);
+    }
+    probing = false;
+
+    for (size_t i = 0; i < PROBE_COUNT; i++) {
+	add_metric(probes[i].name, "_avg", probes[i].calls ? probes[i].total / probes[i].calls : 0);
+	add_metric(probes[i].name, "_max", probes[i].max);
+    }
 
+    uint32_t flash = firmware.flashsize;
+    uint32_t ram = firmware.datasize + firmware.bsssize;
+    add_metric("flash_bytes", "", flash);
+    add_metric("ram_bytes", "", ram);
+    if (flash > FLASH_BUDGET || ram > RAM_BUDGET) {
+	printf("Over the ATmega32u4 budget of %d bytes flash, %d bytes RAM\n", FLASH_BUDGET, RAM_BUDGET);
+	return 1;
+    }
+
+    if (record_path != NULL) {
+	return record_metrics(record_path);
+    }
+    if (baseline_path != NULL) {
+	return compare_metrics(baseline_path);
+    }
     return 0;
 }
+
+// The input history feature report from history.h, as read off the device
+// with tools/feature_dump, report ID first.
+#define HISTORY_REPORT_ID 3
+#define HISTORY_HEADER_SIZE 4
+#define HISTORY_ENTRY_SIZE 4
+
+static const char* replay_path = NULL;
+
+void print_new_reports(uint64_t* reports, avr_cycle_count_t start) {
+    if (host.reports_received == *reports) {
+	return;
+    }
+    *reports = host.reports_received;
+    printf("%10.3f ms  report", cycles_to_ms(host.last_report_cycle - start));
+    for (uint32_t i = 0; i < host.report_length; i++) {
+	printf(" %02x", host.report[i]);
+    }
+    printf("\n");
+}
+
+void replay_for_usec(uint64_t usec, uint64_t* reports, avr_cycle_count_t start) {
+    avr_cycle_count_t end = avr->cycle + usec_to_cycles(usec);
+    while (avr->cycle < end) {
+	step();
+	print_new_reports(reports, start);
+    }
+}
+
+// Plays a recorded input history back through the pins of the direct-wired
+// layout and prints every report the host gets, to see what the host made
+// of the inputs. Analog buttons can't be driven this way and are skipped.
+int scenario_replay() {
+    if (replay_path == NULL) {
+	fprintf(stderr, "Pass the recorded history with --replay\n");
+	return 1;
+    }
+    FILE* file = fopen(replay_path, "rb");
+    if (file == NULL) {
+	fprintf(stderr, "Failed to open %s\n", replay_path);
+	return 1;
+    }
+    uint8_t history[1 + HISTORY_HEADER_SIZE + 256 * HISTORY_ENTRY_SIZE];
+    size_t length = fread(history, 1, sizeof(history), file);
+    fclose(file);
+    if (length < 1 + HISTORY_HEADER_SIZE || history[0] != HISTORY_REPORT_ID) {
+	fprintf(stderr, "%s isn't an input history report\n", replay_path);
+	return 1;
+    }
+
+    uint8_t count = history[1];
+    uint16_t unit_usec = history[3] | (history[4] << 8);
+    if (length < 1 + HISTORY_HEADER_SIZE + count * HISTORY_ENTRY_SIZE) {
+	fprintf(stderr, "%s is truncated\n", replay_path);
+	return 1;
+    }
+    if (enumerate() < 0) {
+	return 1;
+    }
+    run_for_usec(10000);
+
+    avr_cycle_count_t start = avr->cycle;
+    uint64_t reports = host.reports_received;
+    const uint8_t* entry = history + 1 + HISTORY_HEADER_SIZE;
+    for (uint8_t i = 0; i < count; i++, entry += HISTORY_ENTRY_SIZE) {
+	// The oldest delta points at an entry that's been overwritten.
+	if (i > 0) {
+	    replay_for_usec((uint64_t)(entry[0] | (entry[1] << 8)) * unit_usec, &reports, start);
+	}
+	uint16_t buttons = entry[2] | (entry[3] << 8);
+	printf("%10.3f ms  buttons %04x\n", cycles_to_ms(avr->cycle - start), buttons);
+	for (size_t button = 0; button < BUTTON_PIN_COUNT; button++) {
+	    set_button(BUTTON_PINS[button].port, BUTTON_PINS[button].pin, (buttons >> button) & 1);
+	}
+    }
+    replay_for_usec(10000, &reports, start);
+    return 0;
+}
+
+// Boots with the XInput chord held, then checks the device enumerates as an
+// Xbox 360 controller and sends the 20-byte gamepad report.
+int scenario_xinput() {
+    // Buttons 5 and 6.
+    set_button(BUTTON_PINS[5].port, BUTTON_PINS[5].pin, true);
+    set_button(BUTTON_PINS[6].port, BUTTON_PINS[6].pin, true);
+    if (enumerate() < 0) {
+	return 1;
+    }
+    set_button(BUTTON_PINS[5].port, BUTTON_PINS[5].pin, false);
+    set_button(BUTTON_PINS[6].port, BUTTON_PINS[6].pin, false);
+    run_for_usec(10000);
+
+    uint8_t device[18];
+    if (control_transfer((usb_setup_t){0x80, 0x06, 0x0100, 0, sizeof(device)}, device) < (int)sizeof(device)) {
+	fprintf(stderr, "GET_DESCRIPTOR(device) failed\n");
+	return 1;
+    }
+    uint16_t vendor_id = device[8] | (device[9] << 8);
+    uint16_t product_id = device[10] | (device[11] << 8);
+    printf("device class %02x, %04x:%04x\n", device[4], vendor_id, product_id);
+    if (device[4] != 0xFF || vendor_id != 0x045E || product_id != 0x028E) {
+	return 1;
+    }
+
+    // The first button is d-pad left, bit 2 of the button word.
+    set_button(BUTTON_PINS[0].port, BUTTON_PINS[0].pin, true);
+    avr_cycle_count_t latency = measure_next_report(10000);
+    set_button(BUTTON_PINS[0].port, BUTTON_PINS[0].pin, false);
+    if (latency == 0) {
+	printf("no report\n");
+	return 1;
+    }
+    printf("report");
+    for (uint32_t i = 0; i < host.report_length; i++) {
+	printf(" %02x", host.report[i]);
+    }
+    printf("\n");
+    return host.report_length != 20 || host.report[0] != 0x00 || host.report[1] != 20 || host.report[2] != 0x04;
+}
+
+// Runs `run` in a copy of the simulator as it is right now, leaving this
+// process where it was, and returns 0 once the copy has handed back
+// result_size bytes of result. That makes the current state a snapshot
+// that any number of runs can start from without booting and enumerating
+// again.
+//
+// simavr can't save and load a machine: its cycle timers are callbacks and
+// the USB controller's state is private to avr_usb.c. So the copy is a
+// fork(), which takes the firmware, every peripheral and the emulated host
+// along and only copies the pages the run writes to.
+int run_from_snapshot(void (*run)(const void* arg, void* result), const void* arg, void* result, size_t result_size) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+	return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+    }
+    if (pid == 0) {
+	close(fds[0]);
+	run(arg, result);
+	_exit(write(fds[1], result, result_size) == (ssize_t)result_size ? 0 : 1);
+    }
+
+    close(fds[1]);
+    size_t received = 0;
+    ssize_t n;
+    while (received < result_size && (n = read(fds[0], (uint8_t*)result + received, result_size - received)) > 0) {
+	received += n;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (received < result_size || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	return -1;
+    }
+    return 0;
+}
+
+// Press times spread over a millisecond, for each button.
+#define SWEEP_OFFSETS 50
+
+typedef struct {
+    size_t button;
+    uint32_t offset_usec;
+} sweep_run_t;
+
+void sweep_press(const void* arg, void* result) {
+    const sweep_run_t* run = arg;
+    run_for_usec(run->offset_usec);
+    set_button(BUTTON_PINS[run->button].port, BUTTON_PINS[run->button].pin, true);
+    *(avr_cycle_count_t*)result = measure_next_report(10000);
+}
+
+// Press-to-report latency of every button pressed at every offset, each
+// run starting from the same configured device.
+int scenario_sweep() {
+    if (enumerate() < 0) {
+	return 1;
+    }
+    run_for_usec(10000);
+
+    int runs = 0;
+    int failures = 0;
+    avr_cycle_count_t shortest = 0;
+    avr_cycle_count_t longest = 0;
+    avr_cycle_count_t total = 0;
+    for (size_t button = 0; button < BUTTON_PIN_COUNT; button++) {
+	for (uint32_t offset = 0; offset < SWEEP_OFFSETS; offset++) {
+	    sweep_run_t run = {button, offset * 1000 / SWEEP_OFFSETS};
+	    avr_cycle_count_t latency;
+	    if (run_from_snapshot(sweep_press, &run, &latency, sizeof(latency)) < 0 || latency == 0) {
+		printf("button %zu at %u us: no report\n", button, run.offset_usec);
+		failures++;
+		continue;
+	    }
+	    if (runs == 0 || latency < shortest) {
+		shortest = latency;
+	    }
+	    if (latency > longest) {
+		longest = latency;
+	    }
+	    total += latency;
+	    runs++;
+	}
+    }
+
+    if (runs > 0) {
+	printf("%d runs: %.3f ms min, %.3f ms mean, %.3f ms max\n", runs, cycles_to_ms(shortest), cycles_to_ms(total / runs), cycles_to_ms(longest));
+    }
+    return failures != 0;
+}
+
+typedef struct {
+    const char* name;
+    int (*run)();
+} scenario_t;
+
+static const scenario_t SCENARIOS[] = {
+    {"run", scenario_run},
+    {"resume", scenario_resume},
+    {"cycles", scenario_cycles},
+    {"replay", scenario_replay},
+    {"xinput", scenario_xinput},
+    {"sweep", scenario_sweep},
+};
+
+int main(int argc, char *argv[]) {
+    const char* scenario_name = "run";
+    // The firmware is the last argument that isn't an option, so flags
+    // ahead of it in the Makefile's command lines don't matter.
+    const char* firmware_path = "target/fightstick.elf";
+    for (int i = 1; i < argc; i++) {
+	if (argv[i][0] != '-') {
+	    firmware_path = argv[i];
+	} else if (i + 1 == argc) {
+	    break;
+	} else if (strcmp(argv[i], "--scenario") == 0) {
+	    scenario_name = argv[++i];
+	} else if (strcmp(argv[i], "--baseline") == 0) {
+	    baseline_path = argv[++i];
+	} else if (strcmp(argv[i], "--record") == 0) {
+	    record_path = argv[++i];
+	} else if (strcmp(argv[i], "--replay") == 0) {
+	    replay_path = argv[++i];
+	}
+    }
+
+    if (elf_read_firmware(firmware_path, &firmware) < 0) {
+	fprintf(stderr, "Failed to read firmware from %s\n", firmware_path);
+	return 1;
+    }
+
+    avr = avr_make_mcu_by_name(firmware.mmcu);
+    avr_init(avr);
+    avr_load_firmware(avr, &firmware);
+    avr->frequency = FREQUENCY;
+
+    avr_irq_register_notify(
+	avr_io_getirq(avr, AVR_IOCTL_USB_GETIRQ(), USB_IRQ_ATTACH),
+	attach_hook,
+	NULL
+    );
+
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+	if (strcmp(SCENARIOS[i].name, scenario_name) == 0) {
+	    return SCENARIOS[i].run();
+	}
+    }
+    fprintf(stderr, "Unknown scenario %s\n", scenario_name);
+    return 1;
+}
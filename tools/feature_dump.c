@@ -0,0 +1,41 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Reads one feature report off a hidraw node and writes it to stdout as is,
+// report ID first. Use the vendor interface's node, e.g. report 2 for the
+// button health counters and report 3 for the input history, which
+// `make replay` plays back.
+//
+// usage: feature_dump /dev/hidrawN REPORT_ID > report.bin
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s /dev/hidrawN REPORT_ID\n", argv[0]);
+	return 1;
+    }
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd < 0) {
+	fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+	return 1;
+    }
+
+    uint8_t report[256];
+    report[0] = atoi(argv[2]);
+    int length = ioctl(fd, HIDIOCGFEATURE(sizeof(report)), report);
+    close(fd);
+    if (length < 0) {
+	fprintf(stderr, "Failed to read feature report %s: %s\n", argv[2], strerror(errno));
+	return 1;
+    }
+
+    fwrite(report, 1, length, stdout);
+    return 0;
+}
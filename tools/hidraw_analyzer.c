@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pattern.h"
+
+// Reads reports from a hidraw node (the stick, or uhid_standin) and reports
+// how the host actually sees them: effective report rate, inter-report
+// jitter, how many reports repeat the previous one, and with --pattern the
+// frame loss and change-to-report latency of the firmware's test pattern.
+//
+// usage: hidraw_analyzer /dev/hidrawN [--seconds N] [--pattern]
+
+#define MAX_REPORT_SIZE 64
+
+typedef struct {
+    uint64_t reports;
+    uint64_t duplicates;
+    double first_ns;
+    double last_ns;
+    uint8_t previous[MAX_REPORT_SIZE];
+    ssize_t previous_length;
+
+    // Every inter-report interval, for percentiles.
+    double* intervals;
+    size_t interval_count;
+    size_t interval_capacity;
+
+    // --pattern only.
+    bool pattern;
+    int64_t frame;  // Unwrapped frame counter
+    int64_t first_frame;
+    uint64_t changes;
+    // Smallest arrival time minus frame start, used as the frame clock
+    // offset since the host and device clocks aren't synchronised.
+    double frame_offset_ns;
+    double* latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+    int64_t* change_frames;
+    double* change_arrivals;
+} stats_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+void stop(int signal) {
+    stopping = 1;
+}
+
+double now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+void append(double** values, size_t* count, size_t* capacity, double value) {
+    if (*count == *capacity) {
+	*capacity = *capacity ? 2 * *capacity : 4096;
+	*values = realloc(*values, *capacity * sizeof(double));
+    }
+    (*values)[(*count)++] = value;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double* values, size_t count, double fraction) {
+    if (count == 0) {
+	return 0;
+    }
+    return values[(size_t)(fraction * (count - 1))];
+}
+
+void summarize(const char* name, double* values, size_t count) {
+    if (count == 0) {
+	printf("%-18s none\n", name);
+	return;
+    }
+
+    double sum = 0;
+    for (size_t i = 0; i < count; i++) {
+	sum += values[i];
+    }
+    double mean = sum / count;
+    double variance = 0;
+    for (size_t i = 0; i < count; i++) {
+	variance += (values[i] - mean) * (values[i] - mean);
+    }
+
+    qsort(values, count, sizeof(double), compare_doubles);
+    printf(
+	"%-18s mean %.3f ms, stddev %.3f ms, min %.3f ms, p99 %.3f ms, max %.3f ms\n",
+	name,
+	mean / 1e6,
+	sqrt(variance / count) / 1e6,
+	values[0] / 1e6,
+	percentile(values, count, 0.99) / 1e6,
+	values[count - 1] / 1e6
+    );
+}
+
+// Boot protocol reports are exactly PATTERN_REPORT_SIZE bytes, anything
+// longer is the report protocol layout.
+int counter_byte(ssize_t length) {
+    return length == PATTERN_REPORT_SIZE ? PATTERN_COUNTER_BYTE : PATTERN_NKRO_COUNTER_BYTE;
+}
+
+bool same_report(const stats_t* stats, const uint8_t* report, ssize_t length) {
+    if (length != stats->previous_length) {
+	return false;
+    }
+    for (ssize_t i = 0; i < length; i++) {
+	if (stats->pattern && i == counter_byte(length)) {
+	    continue;  // Always differs, it's the frame counter
+	}
+	if (report[i] != stats->previous[i]) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void track_pattern(stats_t* stats, const uint8_t* report, ssize_t length, bool changed, double arrival_ns) {
+    uint8_t counter = report[counter_byte(length)];
+    if (stats->reports == 1) {
+	stats->frame = counter;
+	stats->first_frame = counter;
+    } else {
+	stats->frame += (uint8_t)(counter - (uint8_t)stats->frame);
+    }
+
+    double offset = arrival_ns - stats->frame * (double)PATTERN_FRAME_US * 1000;
+    if (stats->reports == 1 || offset < stats->frame_offset_ns) {
+	stats->frame_offset_ns = offset;
+    }
+
+    if (changed && stats->reports > 1) {
+	// The change happened on the last multiple of the period, whichever
+	// frame the report itself was built in.
+	size_t index = stats->changes++;
+	stats->change_frames = realloc(stats->change_frames, stats->changes * sizeof(int64_t));
+	stats->change_arrivals = realloc(stats->change_arrivals, stats->changes * sizeof(double));
+	stats->change_frames[index] = stats->frame - stats->frame % PATTERN_PERIOD_FRAMES;
+	stats->change_arrivals[index] = arrival_ns;
+    }
+}
+
+void add_report(stats_t* stats, const uint8_t* report, ssize_t length, double arrival_ns) {
+    stats->reports++;
+    if (stats->reports == 1) {
+	stats->first_ns = arrival_ns;
+    } else {
+	append(&stats->intervals, &stats->interval_count, &stats->interval_capacity, arrival_ns - stats->last_ns);
+    }
+    stats->last_ns = arrival_ns;
+
+    bool duplicate = stats->reports > 1 && same_report(stats, report, length);
+    if (duplicate) {
+	stats->duplicates++;
+    }
+    if (stats->pattern && length > counter_byte(length)) {
+	track_pattern(stats, report, length, !duplicate, arrival_ns);
+    }
+
+    memcpy(stats->previous, report, length);
+    stats->previous_length = length;
+}
+
+void print_pattern_stats(stats_t* stats) {
+    // Latency can only be measured against the fastest report seen, since
+    // the frame clock offset comes from the best case.
+    for (uint64_t i = 0; i < stats->changes; i++) {
+	double frame_start = stats->frame_offset_ns + stats->change_frames[i] * (double)PATTERN_FRAME_US * 1000;
+	append(&stats->latencies, &stats->latency_count, &stats->latency_capacity, stats->change_arrivals[i] - frame_start);
+    }
+
+    int64_t frames = stats->frame - stats->first_frame;
+    uint64_t expected = frames / PATTERN_PERIOD_FRAMES;
+    printf("%-18s %llu of %llu expected\n", "pattern changes", (unsigned long long)stats->changes, (unsigned long long)expected);
+    printf(
+	"%-18s %llu\n",
+	"missed changes",
+	(unsigned long long)(expected > stats->changes ? expected - stats->changes : 0)
+    );
+    summarize("change latency", stats->latencies, stats->latency_count);
+}
+
+void print_stats(stats_t* stats) {
+    double duration = (stats->last_ns - stats->first_ns) / 1e9;
+    printf("%-18s %llu\n", "reports", (unsigned long long)stats->reports);
+    printf("%-18s %.3f s\n", "duration", duration);
+    if (stats->reports < 2) {
+	return;
+    }
+
+    printf("%-18s %.1f Hz\n", "report rate", (stats->reports - 1) / duration);
+    printf("%-18s %.2f %%\n", "duplicates", 100.0 * stats->duplicates / stats->reports);
+    summarize("interval", stats->intervals, stats->interval_count);
+    if (stats->pattern) {
+	print_pattern_stats(stats);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s /dev/hidrawN [--seconds N] [--pattern]\n", argv[0]);
+	return 1;
+    }
+
+    stats_t stats = {0};
+    double seconds = 10;
+    for (int i = 2; i < argc; i++) {
+	if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+	    seconds = atof(argv[++i]);
+	} else if (strcmp(argv[i], "--pattern") == 0) {
+	    stats.pattern = true;
+	}
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+	return 1;
+    }
+    // Without SA_RESTART, so Ctrl-C interrupts the wait instead of the wait
+    // carrying on until the next report.
+    struct sigaction action = {.sa_handler = stop};
+    sigaction(SIGINT, &action, NULL);
+
+    double end_ns = now_ns() + seconds * 1e9;
+    uint8_t report[MAX_REPORT_SIZE];
+    while (!stopping && now_ns() < end_ns) {
+	// An idle device with idle rate 0 sends nothing at all, so never wait
+	// past the deadline.
+	struct pollfd ready = {.fd = fd, .events = POLLIN};
+	int count = poll(&ready, 1, (int)((end_ns - now_ns()) / 1e6) + 1);
+	if (count < 0 && errno != EINTR) {
+	    fprintf(stderr, "Failed to poll %s: %s\n", argv[1], strerror(errno));
+	    break;
+	}
+	if (count <= 0) {
+	    continue;
+	}
+
+	ssize_t length = read(fd, report, sizeof(report));
+	double arrival_ns = now_ns();
+	if (length < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fprintf(stderr, "Failed to read %s: %s\n", argv[1], strerror(errno));
+	    break;
+	}
+	add_report(&stats, report, length, arrival_ns);
+    }
+    close(fd);
+
+    print_stats(&stats);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// The latency test pattern shared by hidraw_analyzer and uhid_standin, and
+// emitted by the firmware in its test pattern mode.
+//
+// Reports carry the low 8 bits of the USB frame number they were built in,
+// and a key toggles every PATTERN_PERIOD_FRAMES frames, on frames that are
+// a multiple of the period. Both protocols' layouts have a reserved byte,
+// which is where the counter goes.
+#define PATTERN_REPORT_SIZE 8
+#define PATTERN_COUNTER_BYTE 1
+#define PATTERN_NKRO_COUNTER_BYTE 16
+#define PATTERN_PERIOD_FRAMES 8
+#define PATTERN_FRAME_US 1000
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "pattern.h"
+
+// Creates a virtual boot keyboard through /dev/uhid that sends the latency
+// test pattern every frame, so hidraw_analyzer can be checked against a
+// device with known timing before it's pointed at the stick.
+//
+// usage: uhid_standin [--period-us N] [--drop-every N]
+
+static const uint8_t REPORT_DESCRIPTOR[] = {
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x06,  // Usage (Keyboard)
+    0xA1, 0x01,  // Collection (Application)
+    0x05, 0x07,  // Usage Page (Key Codes)
+    0x19, 0xE0,  // Usage Minimum (224)
+    0x29, 0xE7,  // Usage Maximum (231)
+    0x15, 0x00,  // Logical Minimum (0)
+    0x25, 0x01,  // Logical Maximum (1)
+    0x75, 0x01,  // Report Size (1)
+    0x95, 0x08,  // Report Count (8)
+    0x81, 0x02,  // Input (Data, Variable, Absolute)
+    0x75, 0x08,  // Report Size (8)
+    0x95, 0x01,  // Report Count (1)
+    0x81, 0x01,  // Input (Constant)
+    0x19, 0x00,  // Usage Minimum (0)
+    0x29, 0x65,  // Usage Maximum (101)
+    0x15, 0x00,  // Logical Minimum (0)
+    0x25, 0x65,  // Logical Maximum (101)
+    0x75, 0x08,  // Report Size (8)
+    0x95, 0x06,  // Report Count (6)
+    0x81, 0x00,  // Input (Data, Array, Absolute)
+    0xC0,        // End Collection
+};
+
+#define PATTERN_KEY 0x13  // P
+
+static volatile sig_atomic_t stopping = 0;
+
+void stop(int signal) {
+    stopping = 1;
+}
+
+int write_event(int fd, const struct uhid_event* event) {
+    if (write(fd, event, sizeof(*event)) != sizeof(*event)) {
+	fprintf(stderr, "Failed to write to uhid: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+int create_device(int fd) {
+    struct uhid_event event = {0};
+    event.type = UHID_CREATE2;
+    strcpy((char*)event.u.create2.name, "Stick latency stand-in");
+    event.u.create2.rd_size = sizeof(REPORT_DESCRIPTOR);
+    memcpy(event.u.create2.rd_data, REPORT_DESCRIPTOR, sizeof(REPORT_DESCRIPTOR));
+    event.u.create2.bus = BUS_USB;
+    event.u.create2.vendor = 0x1337;
+    event.u.create2.product = 0x0002;
+    return write_event(fd, &event);
+}
+
+void build_pattern_report(uint8_t* report, uint32_t frame) {
+    memset(report, 0, PATTERN_REPORT_SIZE);
+    report[PATTERN_COUNTER_BYTE] = frame;
+    if ((frame / PATTERN_PERIOD_FRAMES) & 1) {
+	report[2] = PATTERN_KEY;
+    }
+}
+
+int main(int argc, char** argv) {
+    long period_us = PATTERN_FRAME_US;
+    long drop_every = 0;
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--period-us") == 0 && i + 1 < argc) {
+	    period_us = atol(argv[++i]);
+	} else if (strcmp(argv[i], "--drop-every") == 0 && i + 1 < argc) {
+	    // Skip every Nth report, like a device that misses a poll
+	    drop_every = atol(argv[++i]);
+	}
+    }
+
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+	fprintf(stderr, "Failed to open /dev/uhid: %s\n", strerror(errno));
+	return 1;
+    }
+    if (create_device(fd) < 0) {
+	return 1;
+    }
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (timer < 0) {
+	fprintf(stderr, "Failed to create the frame timer: %s\n", strerror(errno));
+	return 1;
+    }
+    struct itimerspec interval = {
+	.it_interval = {period_us / 1000000, (period_us % 1000000) * 1000},
+	.it_value = {period_us / 1000000, (period_us % 1000000) * 1000},
+    };
+    if (timerfd_settime(timer, 0, &interval, NULL) < 0) {
+	fprintf(stderr, "Failed to start the frame timer: %s\n", strerror(errno));
+	return 1;
+    }
+
+    // Without SA_RESTART, so Ctrl-C interrupts the wait for the next frame.
+    struct sigaction action = {.sa_handler = stop};
+    sigaction(SIGINT, &action, NULL);
+
+    // Each timer expiry is one frame; frames that elapse while we're late
+    // still advance the counter, the same as the firmware's SOF counter.
+    uint32_t frame = 0;
+    while (!stopping) {
+	uint64_t expirations;
+	if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+	    continue;
+	}
+	frame += expirations;
+	if (drop_every && frame % drop_every == 0) {
+	    continue;
+	}
+
+	struct uhid_event event = {0};
+	event.type = UHID_INPUT2;
+	event.u.input2.size = PATTERN_REPORT_SIZE;
+	build_pattern_report(event.u.input2.data, frame);
+	if (write_event(fd, &event) < 0) {
+	    break;
+	}
+    }
+
+    struct uhid_event event = {0};
+    event.type = UHID_DESTROY;
+    write_event(fd, &event);
+    close(timer);
+    close(fd);
+    return 0;
+}
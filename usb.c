@@ -5,9 +5,12 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <string.h>
 #include <util/delay.h>
 
+#include "clock.h"
 #include "descriptor.h"
+#include "report.h"
 
 #define DESCRIPTOR_REQUEST_DEVICE 0x01
 #define DESCRIPTOR_REQUEST_CONFIGURATION 0x02
@@ -25,6 +28,16 @@
 #define GET_INTERFACE 0x0A
 #define SET_INTERFACE 0x0B
 
+#define HID_CLASS 0x03
+#define KEYBOARD_PROTOCOL 0x01
+
+// Feature selectors.
+#define DEVICE_REMOTE_WAKEUP 1
+
+// GET_REPORT report types, the high byte of value.
+#define REPORT_TYPE_INPUT 0x01
+#define REPORT_TYPE_FEATURE 0x03
+
 // HID class-specific request codes.
 #define GET_REPORT 0x01
 #define GET_IDLE 0x02
@@ -33,35 +46,96 @@
 #define SET_IDLE 0x0A
 #define SET_PROTOCOL 0x0B
 
-#define KEYBOARD_ENDPOINT_NUM 3  // The second endpoint is the HID endpoint
-
 volatile usb_config_t const* usb_config;
 
 volatile usb_state_t usb_state = USB_STATE_UNKNOWN;
+volatile bool usb_suspended = false;
+volatile bool usb_remote_wakeup_enabled = false;
 
-volatile uint8_t keyboard_pressed_keys[6] = {0, 0, 0, 0, 0, 0};
-
-static uint16_t keyboard_idle_value =
-    125;  // HID Idle setting, how often the device resends unchanging reports,
-          // we are using a scaling of 4 because of the register size
-static uint8_t current_idle =
-    0;  // Counter that updates based on how many SOFE interrupts have occurred
-static uint8_t this_interrupt =
-    0;  // This is not the best way to do it, but it
-        // is much more readable than the alternative
-
-uint8_t keyboard_protocol = 0;
+#define KEYBOARD_REPORT_IDS 1
+#define DEFAULT_IDLE_RATE 125  // 500 ms, the spec's recommendation for keyboards
+#define IDLE_UNIT_MS 4
 
-int usb_init(const usb_config_t* _usb_config) {
-    usb_config = _usb_config;
-  cli();  // Global Interrupt Disable
+typedef struct {
+    // Last report handed to usb_send, kept for idle resends and GET_REPORT.
+    // Until the first one, an NKRO report with nothing pressed.
+    uint8_t report[KEYBOARD_REPORT_SIZE];
+    uint8_t report_length;
+
+    // Set when no report has gone out on this configuration yet, so the
+    // next one is sent even if it matches.
+    bool resend;
+
+    // HID idle rates in 4 ms units, how often an unchanged report is sent
+    // again. 0 means only send on change. Indexed by report ID, where ID 0
+    // applies to every report; the keyboard doesn't use report IDs, so
+    // that's the only one.
+    uint8_t idle_rates[KEYBOARD_REPORT_IDS];
+    uint16_t ms_since_report;  // Counted in SOFs
+} keyboard_t;
+
+static keyboard_t keyboards[USB_MAX_KEYBOARDS] = {
+    [0 ... USB_MAX_KEYBOARDS - 1] = {
+	.report_length = NKRO_REPORT_SIZE,
+	.resend = true,
+	.idle_rates = {DEFAULT_IDLE_RATE},
+    },
+};
+
+static const uint8_t KEYBOARD_INTERFACES[USB_MAX_KEYBOARDS] = {
+    KEYBOARD_INTERFACE_NUM,
+    KEYBOARD2_INTERFACE_NUM,
+};
+
+static const uint8_t KEYBOARD_ENDPOINTS[USB_MAX_KEYBOARDS] = {
+    KEYBOARD_ENDPOINT_NUM,
+    KEYBOARD2_ENDPOINT_NUM,
+};
+
+// How many of the keyboards the configuration has, set on SET_CONFIGURATION.
+static uint8_t num_keyboards = 1;
+
+// Whether the configuration has the vendor interface, set on
+// SET_CONFIGURATION. The XInput personality's doesn't.
+static bool has_vendor_interface = false;
+
+// Same for the joystick interface, which only single player builds have.
+static bool has_joystick_interface = false;
+
+// Last report handed to usb_send_joystick, for GET_REPORT. Until the
+// first one, centered axes. The joystick only ever sends on change.
+static uint8_t joystick_report[JOYSTICK_REPORT_SIZE] = {[0 ... AXES_REPORT_SIZE - 1] = 128};
+static uint8_t joystick_report_length = AXES_REPORT_SIZE;
+static bool joystick_resend = true;
+
+static volatile uint16_t frame_start = 0;
+
+// HID devices start out in report protocol.
+volatile uint8_t keyboard_protocols[USB_MAX_KEYBOARDS] = {[0 ... USB_MAX_KEYBOARDS - 1] = 1};
+
+// Which keyboard an interface is, or -1 for any other interface.
+int8_t keyboard_for_interface(uint8_t interface) {
+    for (uint8_t i = 0; i < num_keyboards; i++) {
+	if (KEYBOARD_INTERFACES[i] == interface) {
+	    return i;
+	}
+    }
+    return -1;
+}
 
+void usb_power_up() {
   UHWCON |= (1 << UVREGE);  // Enable USB Pads Regulator
 
   PLLCSR |= 0x12;  // Configure to use 16mHz oscillator
+}
 
+int usb_init(const usb_config_t* _usb_config) {
+    usb_config = _usb_config;
+  usb_power_up();
   while (!(PLLCSR & (1 << PLOCK)))
-    ;  // Wait for PLL Lock to be achieved
+    ;  // Wait for PLL Lock to be achieved, usually already there
+
+  cli();  // Global Interrupt Disable
 
   USBCON |=
       (1 << USBE) | (1 << OTGPADE);  // Enable USB Controller and USB power pads
@@ -71,38 +145,185 @@ int usb_init(const usb_config_t* _usb_config) {
   UDCON &= ~(1<<DETACH);  // Attach USB Controller to the data bus
 
   UDIEN |= (1 << EORSTE) |
-           (1 << SOFE);  // Re-enable the EORSTE (End Of Reset) Interrupt so we
-                         // know when we can configure the control endpoint
+           (1 << SOFE) |
+           (1 << SUSPE);  // Re-enable the EORSTE (End Of Reset) Interrupt so we
+                          // know when we can configure the control endpoint,
+                          // and listen for the host suspending the bus
   usb_state = USB_STATE_DISCONNECTED;
   sei();  // Global Interrupt Enable
   return 0;
 }
 
-int usb_send() {
-    if (usb_state != USB_STATE_ATTACHED) {
+void unfreeze_usb_clock() {
+    PLLCSR |= (1 << PLLE);
+    while (!(PLLCSR & (1 << PLOCK)))
+	;  // The PLL was off while suspended, wait for it to lock again
+    USBCON &= ~(1 << FRZCLK);
+}
+
+int usb_remote_wakeup() {
+    if (!usb_suspended || !usb_remote_wakeup_enabled) {
+	return -1;
+    }
+
+    cli();
+    unfreeze_usb_clock();
+    UDCON |= (1 << RMWKUP);  // Cleared by hardware once resume has been signalled
+    sei();
+
+    // The host answers with resume signalling of its own, which raises
+    // WAKEUPI and clears usb_suspended.
+    return 0;
+}
+
+int usb_send_telemetry(const uint8_t* data, uint8_t length) {
+    if (usb_state != USB_STATE_ATTACHED || usb_suspended || !has_vendor_interface) {
+	return -1;
+    }
+    if (length > VENDOR_DATA_SIZE) {
+	length = VENDOR_DATA_SIZE;
+    }
+
+    cli();
+    UENUM = VENDOR_IN_ENDPOINT_NUM;
+    if (!(UEINTX & (1 << RWAL))) {
+	// Both banks are still waiting on the host, drop this report
+	// rather than stall the caller.
+	sei();
+	return -1;
+    }
+    UEDATX = VENDOR_REPORT_ID_DATA;
+    for (uint8_t i = 0; i < VENDOR_DATA_SIZE; i++) {
+	UEDATX = i < length ? data[i] : 0;
+    }
+    UEINTX = 0b00111010;
+    sei();
+    return 0;
+}
+
+int usb_receive_config(uint8_t* data, uint8_t length) {
+    if (usb_state != USB_STATE_ATTACHED || usb_suspended) {
+	return 0;
+    }
+
+    cli();
+    UENUM = VENDOR_OUT_ENDPOINT_NUM;
+    if (!(UEINTX & (1 << RXOUTI))) {
+	sei();
+	return 0;
+    }
+    uint8_t received = 0;
+    if (UEBCLX > 0 && UEDATX == VENDOR_REPORT_ID_DATA) {
+	received = UEBCLX;  // The count goes down as bytes are read
+	if (received > length) {
+	    received = length;
+	}
+	for (uint8_t i = 0; i < received; i++) {
+	    data[i] = UEDATX;
+	}
+    }
+    UEINTX &= ~(1 << RXOUTI);
+    UEINTX &= ~(1 << FIFOCON);  // Release the bank, dropping any unread bytes
+    sei();
+    return received;
+}
+
+int usb_send(uint8_t keyboard, const uint8_t* report, uint8_t length) {
+    if (usb_state != USB_STATE_ATTACHED || usb_suspended || keyboard >= num_keyboards) {
 	return -1;
     }
 
+  // Unchanged reports are the idle engine's job, and only if the host
+  // asked for them.
+  keyboard_t* state = &keyboards[keyboard];
+  if (!state->resend && length == state->report_length && memcmp(report, state->report, length) == 0) {
+    return 0;
+  }
+
   cli();
-  UENUM = KEYBOARD_ENDPOINT_NUM;
-
-  while (!(UEINTX & (1 << RWAL)))
-    ;  // Wait for banks to be ready
-  UEDATX = 0; // modifier
-  UEDATX = 0; // reserved byte
-  for (int i = 0; i < 6; i++) {
-    UEDATX = keyboard_pressed_keys[i];
+  UENUM = KEYBOARD_ENDPOINTS[keyboard];
+  if (!(UEINTX & (1 << RWAL))) {
+    // Both banks are still waiting on the host. Leave the last report as
+    // it is, so the caller's next report counts as a change and goes out
+    // as soon as a bank frees up, without holding up the other keyboard.
+    sei();
+    return -1;
+  }
+  state->report_length = length;
+  state->resend = false;
+  for (uint8_t i = 0; i < length; i++) {
+    state->report[i] = report[i];
+    UEDATX = report[i];
   }
 
   UEINTX = 0b00111010;
-  current_idle = 0;
+  state->ms_since_report = 0;
   sei();
   return 0;
 }
 
+int usb_send_joystick(const uint8_t* report, uint8_t length) {
+    if (usb_state != USB_STATE_ATTACHED || usb_suspended || !has_joystick_interface) {
+	return -1;
+    }
+    if (!joystick_resend && length == joystick_report_length && memcmp(report, joystick_report, length) == 0) {
+	return 0;
+    }
+
+    cli();
+    UENUM = JOYSTICK_ENDPOINT_NUM;
+    if (!(UEINTX & (1 << RWAL))) {
+	sei();
+	return -1;
+    }
+    joystick_report_length = length;
+    joystick_resend = false;
+    for (uint8_t i = 0; i < length; i++) {
+	joystick_report[i] = report[i];
+	UEDATX = report[i];
+    }
+    UEINTX = 0b00111010;
+    sei();
+    return 0;
+}
+
+uint16_t usb_frame_number() {
+    uint8_t low = UDFNUML;  // Low byte first, like every 16-bit register pair
+    return ((UDFNUMH & 0x07) << 8) | low;
+}
+
+uint16_t usb_frame_start() {
+    cli();
+    uint16_t ticks = frame_start;
+    sei();
+    return ticks;
+}
+
 ISR(USB_GEN_vect) {
+  // Clear only the flags that are about to be handled. SUSPI stays set
+  // for as long as we're suspended, the hardware only signals remote
+  // wakeup then.
   uint8_t udint_temp = UDINT;
-  UDINT = 0;
+  UDINT &= ~(udint_temp & ~(1 << SUSPI));
+
+  if ((udint_temp & (1 << SUSPI)) && (UDIEN & (1 << SUSPE))) {
+    // 3 ms without bus activity, the host is suspending us. Drop to the
+    // suspend current budget by freezing the USB clock and stopping the
+    // PLL, and wait for bus activity to wake us back up.
+    UDIEN &= ~(1 << SUSPE);
+    UDIEN |= (1 << WAKEUPE);
+    USBCON |= (1 << FRZCLK);
+    PLLCSR &= ~(1 << PLLE);
+    usb_suspended = true;
+    return;
+  }
+  if ((udint_temp & (1 << WAKEUPI)) && (UDIEN & (1 << WAKEUPE))) {
+    unfreeze_usb_clock();
+    UDINT &= ~((1 << WAKEUPI) | (1 << SUSPI));  // Can only be cleared with the clock running
+    UDIEN &= ~(1 << WAKEUPE);
+    UDIEN |= (1 << SUSPE);
+    usb_suspended = false;
+  }
 
   if (udint_temp & (1 << EORSTI)) {  // If end of reset interrupt
     // Configure Control Endpoint
@@ -111,6 +332,13 @@ ISR(USB_GEN_vect) {
     UECFG0X = 0;      // Control Endpoint, OUT direction for control endpoint
     UECFG1X |= 0x22;  // 32 byte endpoint, 1 bank, allocate the memory
     usb_state = USB_STATE_DISCONNECTED;
+    usb_remote_wakeup_enabled = false;
+    for (uint8_t i = 0; i < USB_MAX_KEYBOARDS; i++) {
+      keyboard_protocols[i] = 1;  // A bus reset puts HID devices back in report protocol
+      for (uint8_t id = 0; id < KEYBOARD_REPORT_IDS; id++) {
+        keyboards[i].idle_rates[id] = DEFAULT_IDLE_RATE;
+      }
+    }
 
     if (!(UESTA0X &
           (1 << CFGOK))) {  // Check if endpoint configuration was successful
@@ -127,22 +355,21 @@ ISR(USB_GEN_vect) {
   if ((udint_temp & (1 << SOFI)) && usb_state == USB_STATE_ATTACHED) {  // Check for Start Of Frame Interrupt and correct
                             // usb configuration, send keypress if a keypress
                             // event has not been sent through usb_send
-    this_interrupt++;
-    if (keyboard_idle_value &&
-        (this_interrupt & 3) == 0) {  // Scaling by four, trying to save memory
-      UENUM = KEYBOARD_ENDPOINT_NUM;
+    frame_start = clock_ticks();
+    for (uint8_t keyboard = 0; keyboard < num_keyboards; keyboard++) {
+      // Every report a keyboard sends has the same (absent) report ID.
+      keyboard_t* state = &keyboards[keyboard];
+      state->ms_since_report++;
+      if (state->idle_rates[0] == 0 || state->ms_since_report < state->idle_rates[0] * IDLE_UNIT_MS) {
+        continue;
+      }
+      UENUM = KEYBOARD_ENDPOINTS[keyboard];
       if (UEINTX & (1 << RWAL)) {  // Check if banks are writable
-        current_idle++;
-        if (current_idle ==
-            keyboard_idle_value) {  // Have we reached the idle threshold?
-          current_idle = 0;
-          UEDATX = 0; // modifier
-          UEDATX = 0; // reserved byte
-          for (int i = 0; i < 6; i++) {
-            UEDATX = keyboard_pressed_keys[i];
-          }
-          UEINTX = 0b00111010;
+        state->ms_since_report = 0;
+        for (uint8_t i = 0; i < state->report_length; i++) {
+          UEDATX = state->report[i];
         }
+        UEINTX = 0b00111010;
       }
     }
   }
@@ -242,36 +469,60 @@ int write_device_descriptor(uint16_t request_length) {
     );
 }
 
+uint8_t get_num_interfaces() {
+    return pgm_read_byte(&usb_config->configuration_descriptors[0]->num_interfaces);
+}
+
+uint8_t get_num_endpoints(uint8_t interface) {
+    return pgm_read_byte(&usb_config->interface_descriptors[interface]->num_endpoints);
+}
+
+bool is_hid_interface(uint8_t interface) {
+    return pgm_read_byte(&usb_config->interface_descriptors[interface]->interface_class) == HID_CLASS;
+}
+
+bool is_keyboard_interface(uint8_t interface) {
+    return is_hid_interface(interface) && pgm_read_byte(&usb_config->interface_descriptors[interface]->interface_protocol) == KEYBOARD_PROTOCOL;
+}
+
 int write_configuration_descriptor(uint16_t request_length) {
-    // TODO: make this write out _all_ of the descriptors...
-    uint8_t const* descriptors[4] = {
-	(const uint8_t *)usb_config->configuration_descriptors[0],
-	(uint8_t const*)usb_config->interface_descriptors[0],
-	(uint8_t const*)usb_config->hid_descriptors[0],
-	(uint8_t const*)usb_config->endpoint_descriptors[0],
-    };
+    uint8_t const* descriptors[1 + 2 * USB_MAX_INTERFACES + USB_MAX_ENDPOINTS];
+    uint8_t descriptors_length = 0;
+    descriptors[descriptors_length++] = (uint8_t const*)usb_config->configuration_descriptors[0];
+
+    // Each interface is followed by its class descriptor and then its
+    // endpoints, which is the order hosts expect to parse them in.
+    uint8_t endpoint = 0;
+    for (uint8_t interface = 0; interface < get_num_interfaces(); interface++) {
+	descriptors[descriptors_length++] = (uint8_t const*)usb_config->interface_descriptors[interface];
+	descriptors[descriptors_length++] = usb_config->class_descriptors[interface];
+	for (uint8_t i = 0; i < get_num_endpoints(interface); i++) {
+	    descriptors[descriptors_length++] = (uint8_t const*)usb_config->endpoint_descriptors[endpoint++];
+	}
+    }
+
     return write_descriptors(
 	request_length,
 	descriptors,
-	4
+	descriptors_length
     );
 }
 
-int write_hid_report_descriptor(uint16_t request_length) {
+int write_hid_report_descriptor(uint16_t request_length, uint8_t interface) {
     return write_descriptor(
 	request_length,
-	(uint8_t const*)usb_config->hid_descriptors[0],
+	usb_config->class_descriptors[interface],
 	sizeof(HIDDescriptor)
     );
 }
 
-int write_report_descriptor(uint16_t request_length) {
+int write_report_descriptor(uint16_t request_length, uint8_t interface) {
     // TODO: this isn't actually a normal descriptor
     // and so it can't use the pgm_read_byte(...) of the first element
     return write_descriptor(
 	request_length,
-	usb_config->report_descriptor,
-	usb_config->report_descriptor_length
+	usb_config->report_descriptors[interface],
+	usb_config->report_descriptor_lengths[interface]
     );
 }
 
@@ -284,7 +535,20 @@ typedef struct {
 } USBRequest;
 
 int handle_usb_get_descriptor_request(USBRequest* request) {
-    switch (request->value >> 8) {
+    // HID and report descriptor requests carry the interface number in
+    // the index.
+    uint8_t interface = request->index;
+    if (interface >= get_num_interfaces()) {
+	interface = 0;
+    }
+
+    uint8_t type = request->value >> 8;
+    if ((type == DESCRIPTOR_REQUEST_HID || type == DESCRIPTOR_REQUEST_REPORT) && !is_hid_interface(interface)) {
+	UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	return -1;
+    }
+
+    switch (type) {
     case DESCRIPTOR_REQUEST_DEVICE:
 	write_device_descriptor(request->length);
 	break;
@@ -292,21 +556,37 @@ int handle_usb_get_descriptor_request(USBRequest* request) {
 	write_configuration_descriptor(request->length);
 	break;
     case DESCRIPTOR_REQUEST_HID:
-	write_hid_report_descriptor(request->length);
+	write_hid_report_descriptor(request->length, interface);
 	break;
     case DESCRIPTOR_REQUEST_REPORT:
-	write_report_descriptor(request->length);
+	write_report_descriptor(request->length, interface);
 	break;
     default:
 	// Enable the endpoint and stall, the
 	// descriptor does not exist
-	PORTC = 0xFF;
 	UECONX |= (1 << STALLRQ) | (1 << EPEN);
 	return -1;
     }
     return 0;
 }
 
+void configure_endpoint(const EndpointDescriptor* descriptor) {
+    uint8_t address = pgm_read_byte(&descriptor->endpoint_address);
+    uint8_t attributes = pgm_read_byte(&descriptor->attributes);
+    uint16_t max_packet_size = pgm_read_word(&descriptor->max_packet_size);
+
+    // EPSIZE is log2(size / 8).
+    uint8_t size = 0;
+    while ((8 << size) < max_packet_size) {
+	size++;
+    }
+
+    UENUM = address & 0x0F;
+    UECONX = (1 << EPEN);
+    UECFG0X = ((attributes & 0b11) << EPTYPE0) | ((address & 0x80) ? (1 << EPDIR) : 0);
+    UECFG1X = (size << EPSIZE0) | (1 << EPBK0) | (1 << ALLOC);  // Dual bank
+}
+
 int handle_set_configuration_request(USBRequest* request) {
     if (request->request_type != 0) {
 	return 0;
@@ -314,11 +594,35 @@ int handle_set_configuration_request(USBRequest* request) {
 
     usb_state = USB_STATE_ATTACHED;
     UEINTX &= ~(1 << TXINI);
-    UENUM = KEYBOARD_ENDPOINT_NUM;
-    UECONX = 1;
-    UECFG0X = 0b11000001;  // EPTYPE Interrupt IN
-    UECFG1X = 0b00000110;  // Dual Bank Endpoint, 8 Bytes, allocate memory
-    UERST = 0x1E;          // Reset all of the endpoints
+
+    // The endpoint descriptors are listed in ascending endpoint order,
+    // which is the order the DPRAM has to be allocated in.
+    uint8_t num_endpoints = 0;
+    for (uint8_t interface = 0; interface < get_num_interfaces(); interface++) {
+	num_endpoints += get_num_endpoints(interface);
+    }
+    for (uint8_t i = 0; i < num_endpoints; i++) {
+	configure_endpoint(usb_config->endpoint_descriptors[i]);
+    }
+    // Player 2's keyboard and the joystick share an interface number.
+    bool has_third_interface = get_num_interfaces() > KEYBOARD2_INTERFACE_NUM;
+    num_keyboards = has_third_interface && is_keyboard_interface(KEYBOARD2_INTERFACE_NUM) ? 2 : 1;
+    has_joystick_interface = has_third_interface && !is_keyboard_interface(JOYSTICK_INTERFACE_NUM);
+    joystick_resend = true;
+    has_vendor_interface = get_num_interfaces() > VENDOR_INTERFACE_NUM;
+    for (uint8_t i = 0; i < num_keyboards; i++) {
+	// No report has gone out on this configuration, so the main loop's
+	// next one goes out whatever it holds.
+	keyboards[i].resend = true;
+	keyboards[i].ms_since_report = 0;
+
+	// Only HID hosts send SET_IDLE. Without HID (the XInput personality)
+	// reports only go out on change, like a real pad's.
+	if (!is_hid_interface(KEYBOARD_INTERFACES[i])) {
+	    keyboards[i].idle_rates[0] = 0;
+	}
+    }
+    UERST = 0x7E;  // Reset all of the endpoints
     UERST = 0;
     return 0;
 }
@@ -343,36 +647,143 @@ int handle_get_configuration_request(USBRequest* request) {
 
 int handle_get_status_request(USBRequest* request) {
     while ((UEINTX & (1 << TXINI)) == 0) {}
-    UEDATX = 0;
+    if (request->request_type == 0x80) {
+	UEDATX = usb_remote_wakeup_enabled << 1;  // Device status, bus powered
+    } else {
+	UEDATX = 0;
+    }
     UEDATX = 0;
     UEINTX &= ~(1 << TXINI);
     return 0;
 }
 
-int handle_get_report_request(USBRequest* request) {
-    while ((UEINTX & (1 << TXINI)) == 0) {}
-    UEDATX = 0; // modifier
-    UEDATX = 0; // reserved byte
-    for (int i = 0; i < 6; i++) {
-	UEDATX = keyboard_pressed_keys
-	    [i];  // According to the spec, this method of getting the
-	// report is not used for device polling, although we
-	// still have to implement the response
+int handle_set_feature_request(USBRequest* request, bool enable) {
+    // Endpoint halt is accepted but ignored, our endpoints never halt.
+    if (request->request_type == 0 && request->value == DEVICE_REMOTE_WAKEUP) {
+	usb_remote_wakeup_enabled = enable;
     }
-    UEINTX &= ~(1 << TXINI);
+    UEINTX &= ~(1 << TXINI);  // Send ACK and clear TX bit
     return 0;
 }
 
+int write_report(uint16_t request_length, const uint8_t* report, uint8_t report_length) {
+    if (report_length > request_length) {
+	report_length = request_length;
+    }
+
+    // Same as write_descriptor, but from RAM.
+    uint8_t remaining = report_length;
+    while (remaining > 0) {
+	while ((UEINTX & (1 << TXINI)) == 0) {}
+	if ((UEINTX & (1 << RXOUTI)) != 0) {
+	    return -1;
+	}
+
+	uint8_t packet_size = remaining;
+	if (packet_size > 32) {
+	    packet_size = 32;
+	}
+	for (uint8_t i = 0; i < packet_size; i++) {
+	    UEDATX = report[i];
+	}
+
+	remaining -= packet_size;
+	report += packet_size;
+	UEINTX &= ~(1 << TXINI);
+    }
+    return report_length;
+}
+
+// Like write_report, but the vendor feature report is read a packet at a
+// time as it goes out.
+int write_feature_report(uint16_t request_length, uint8_t report_id, uint8_t report_length) {
+    if (report_length > request_length) {
+	report_length = request_length;
+    }
+
+    uint8_t packet[32];
+    uint8_t offset = 0;
+    while (offset < report_length) {
+	while ((UEINTX & (1 << TXINI)) == 0) {}
+	if ((UEINTX & (1 << RXOUTI)) != 0) {
+	    return -1;
+	}
+
+	uint8_t packet_size = report_length - offset;
+	if (packet_size > 32) {
+	    packet_size = 32;
+	}
+	usb_config->read_vendor_feature_report(report_id, offset, packet, packet_size);
+	for (uint8_t i = 0; i < packet_size; i++) {
+	    UEDATX = packet[i];
+	}
+
+	offset += packet_size;
+	UEINTX &= ~(1 << TXINI);
+    }
+    return report_length;
+}
+
+int handle_get_report_request(USBRequest* request) {
+    int8_t keyboard = keyboard_for_interface(request->index);
+    if (has_joystick_interface && request->index == JOYSTICK_INTERFACE_NUM) {
+	// Its only report is the input report.
+	if ((request->value >> 8) != REPORT_TYPE_INPUT) {
+	    UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	    return -1;
+	}
+	return write_report(request->length, joystick_report, joystick_report_length);
+    }
+    if (keyboard < 0) {
+	// Input and output reports only go over the vendor interface's own
+	// endpoints, the feature report is the only one it answers here.
+	if ((request->value >> 8) != REPORT_TYPE_FEATURE) {
+	    UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	    return -1;
+	}
+
+	// The report ID is the low byte of value.
+	uint8_t report_id = request->value;
+	uint8_t length = usb_config->read_vendor_feature_report(report_id, 0, NULL, 0);
+	if (length == 0) {
+	    UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	    return -1;
+	}
+	return write_feature_report(request->length, report_id, length);
+    }
+
+    // According to the spec, this method of getting the report is not
+    // used for device polling, although we still have to implement the
+    // response.
+    return write_report(request->length, keyboards[keyboard].report, keyboards[keyboard].report_length);
+}
+
 int handle_get_idle_request(USBRequest* request) {
+    // The report ID is the low byte of value.
+    uint8_t report_id = request->value;
+    int8_t keyboard = keyboard_for_interface(request->index);
+    if (keyboard >= 0 && report_id >= KEYBOARD_REPORT_IDS) {
+	UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	return -1;
+    }
+
     while ((UEINTX & (1 << TXINI)) == 0) {}
-    UEDATX = keyboard_idle_value;
+    // Only the keyboards resend, so every other interface's idle rate is
+    // always 0.
+    UEDATX = keyboard >= 0 ? keyboards[keyboard].idle_rates[report_id] : 0;
     UEINTX &= ~(1 << TXINI);
     return 0;
 }
 
 int handle_get_protocol_request(USBRequest* request) {
+    int8_t keyboard = keyboard_for_interface(request->index);
+    if (keyboard < 0) {
+	UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	return -1;
+    }
+
     while ((UEINTX & (1 << TXINI)) == 0) {}
-    UEDATX = keyboard_protocol;
+    UEDATX = keyboard_protocols[keyboard];
     UEINTX &= ~(1 << TXINI);
     return 0;
 }
@@ -387,17 +798,42 @@ int handle_set_report_request(USBRequest* request) {
 }
 
 int handle_set_idle_request(USBRequest* request) {
-    keyboard_idle_value = request->value;  //
-    current_idle = 0;
+    int8_t keyboard = keyboard_for_interface(request->index);
+    if (keyboard < 0) {
+	// Hosts send SET_IDLE to every HID interface, but only the
+	// keyboards resend reports on their own.
+	UEINTX &= ~(1 << TXINI);
+	return 0;
+    }
+
+    // The duration is the high byte of value, the report ID the low byte.
+    // The keyboard has no report IDs, so 0 is the only valid one.
+    uint8_t rate = request->value >> 8;
+    uint8_t report_id = request->value;
+    if (report_id >= KEYBOARD_REPORT_IDS) {
+	UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	return -1;
+    }
+    keyboard_t* state = &keyboards[keyboard];
+    state->idle_rates[0] = rate;
+    // The spec restarts the current period with the new rate.
+    state->ms_since_report = 0;
 
     UEINTX &= ~(1 << TXINI);  // Send ACK and clear TX bit
     return 0;
 }
 
 int handle_set_protocol_request(USBRequest* request) {
-    keyboard_protocol =
-	request->value >> 8;  // Nobody cares what happens to this, arbitrary cast
-    // from 16 bit to 8 bit doesn't matter
+    int8_t keyboard = keyboard_for_interface(request->index);
+    if (keyboard < 0) {
+	// Only the keyboard interfaces have a boot protocol.
+	UECONX |= (1 << STALLRQ) | (1 << EPEN);
+	return -1;
+    }
+
+    // The protocol is the low byte of value, 0 = boot and 1 = report. The
+    // main loop indexes its report builders with it, so keep it in range.
+    keyboard_protocols[keyboard] = request->value & 1;
 
     UEINTX &= ~(1 << TXINI);  // Send ACK and clear TX bit
     return 0;
@@ -409,29 +845,36 @@ int handle_usb_request() {
 	((uint8_t*)&request)[i] = UEDATX;
     }
 
-    DDRC = 0xFF;
     UEINTX &= ~(
         (1 << RXSTPI) | (1 << RXOUTI) |
         (1 << TXINI));  // Handshake the Interrupts, do this after recording
                         // the packet because it also clears the endpoint banks
 
-    // General USB requests.
-    switch (request.request) {
-    case GET_DESCRIPTOR:
-	return handle_usb_get_descriptor_request(&request);
-    case SET_CONFIGURATION:
-	return handle_set_configuration_request(&request);
-    case SET_ADDRESS:
-	return handle_set_address_request(&request);
-    case GET_CONFIGURATION:
-	return handle_get_configuration_request(&request);
-    case GET_STATUS:
-	return handle_get_status_request(&request);
+    // General USB requests. Their codes overlap with the HID class
+    // requests (SET_FEATURE and GET_PROTOCOL are both 0x03), so only look
+    // at standard requests here.
+    if ((request.request_type & 0b01100000) == 0) {
+	switch (request.request) {
+	case GET_DESCRIPTOR:
+	    return handle_usb_get_descriptor_request(&request);
+	case SET_CONFIGURATION:
+	    return handle_set_configuration_request(&request);
+	case SET_ADDRESS:
+	    return handle_set_address_request(&request);
+	case GET_CONFIGURATION:
+	    return handle_get_configuration_request(&request);
+	case GET_STATUS:
+	    return handle_get_status_request(&request);
+	case SET_FEATURE:
+	    return handle_set_feature_request(&request, true);
+	case CLEAR_FEATURE:
+	    return handle_set_feature_request(&request, false);
+	}
+	return -1;
     }
 
     // All class-specific requests have index == the interface number.
-    // Our interface number happens to be 0 so...easy hack.
-    if (request.index != 0) {
+    if (request.index >= get_num_interfaces()) {
 	return -1;
     }
 
@@ -467,7 +910,6 @@ ISR(USB_COM_vect) {
       }
       return;
   }
-  PORTC = 0xFF;
   UECONX |= (1 << STALLRQ) |
       (1 << EPEN);  // The host made an invalid request or there was an
   // error with one of the request parameters
@@ -5,18 +5,82 @@
 
 #include "descriptor.h"
 
+// Interface numbers of the composite device. The keyboard interface carries
+// the input reports, the vendor interface carries config and telemetry so it
+// never shares an endpoint with the input path. In two player mode the
+// second player gets a keyboard interface and endpoint of its own.
+#define KEYBOARD_INTERFACE_NUM 0
+#define VENDOR_INTERFACE_NUM 1
+#define KEYBOARD2_INTERFACE_NUM 2
+
+#define KEYBOARD_ENDPOINT_NUM 3
+#define VENDOR_IN_ENDPOINT_NUM 4
+#define VENDOR_OUT_ENDPOINT_NUM 5
+#define KEYBOARD2_ENDPOINT_NUM 6
+
+// Single player builds have the analog axes on a joystick interface in the
+// second player's place. Hosts open keyboards exclusively (Windows does),
+// so nothing could read axes that were part of the keyboard's reports.
+#define JOYSTICK_INTERFACE_NUM KEYBOARD2_INTERFACE_NUM
+#define JOYSTICK_ENDPOINT_NUM KEYBOARD2_ENDPOINT_NUM
+
+#define USB_MAX_KEYBOARDS 2
+
+// The XInput personality is a single vendor class interface that takes the
+// keyboard's place and IN endpoint, plus an OUT endpoint for the rumble and
+// LED commands hosts send it.
+#define XINPUT_INTERFACE_NUM KEYBOARD_INTERFACE_NUM
+#define XINPUT_IN_ENDPOINT_NUM KEYBOARD_ENDPOINT_NUM
+#define XINPUT_OUT_ENDPOINT_NUM VENDOR_OUT_ENDPOINT_NUM
+
+// Largest report the keyboard endpoint carries, see report.h for layouts.
+#define KEYBOARD_REPORT_SIZE 32
+#define JOYSTICK_REPORT_SIZE 8
+#define VENDOR_REPORT_SIZE 32
+
+// The vendor interface's reports, each prefixed with its ID. Telemetry and
+// config share an ID and go over the interface's endpoints, the feature
+// reports are read with GET_REPORT over the control endpoint so they aren't
+// bound by the endpoint size.
+#define VENDOR_REPORT_ID_DATA 1
+#define VENDOR_REPORT_ID_HEALTH 2
+#define VENDOR_REPORT_ID_HISTORY 3
+#define VENDOR_DATA_SIZE (VENDOR_REPORT_SIZE - 1)
+#define VENDOR_FEATURE_REPORT_MAX_SIZE 255
+
+#define USB_MAX_INTERFACES 4
+#define USB_MAX_ENDPOINTS 6
+
 typedef struct {
     const DeviceDescriptor* device_descriptor;
     const ConfigurationDescriptor** configuration_descriptors;
+
+    // Indexed by interface number, and num_interfaces of the configuration
+    // descriptor says how many there are. Every interface has exactly one
+    // class descriptor following it, its HID descriptor for HID interfaces,
+    // and the length is its first byte. Only HID interfaces have report
+    // descriptors.
     const InterfaceDescriptor** interface_descriptors;
+    const uint8_t** class_descriptors;
+    const uint8_t** report_descriptors;
+    const uint8_t* report_descriptor_lengths;
+
+    // Endpoints of every interface back-to-back, in interface order.
+    // num_endpoints of each interface descriptor says how many belong to it.
     const EndpointDescriptor** endpoint_descriptors;
-    const HIDDescriptor** hid_descriptors;
 
-    // TODO: get rid of this special case...
-    uint8_t report_descriptor_length;
-    const uint8_t* report_descriptor;
+    // Fills in length bytes of the vendor interface's feature report with
+    // the given ID from offset on, where the report starts with its ID, and
+    // returns the whole report's length, or 0 if there's no such report.
+    // Called from the USB interrupt once for the length and then a packet
+    // at a time, so the report never has to be in RAM all at once.
+    uint8_t (*read_vendor_feature_report)(uint8_t report_id, uint8_t offset, uint8_t* chunk, uint8_t length);
 } usb_config_t;
 
+// Starts the pad regulator and the PLL without waiting for it to lock, so
+// other setup can run while it does. usb_init does this itself when it
+// hasn't been called.
+void usb_power_up();
 int usb_init(const usb_config_t* usb_config);
 
 typedef enum {
@@ -26,6 +90,38 @@ typedef enum {
 } usb_state_t;
 
 extern volatile usb_state_t usb_state;
-extern volatile uint8_t keyboard_pressed_keys[6];
 
-int usb_send();
+// Set while the host has the bus suspended. The USB clock is frozen and the
+// PLL is off, so nothing can be sent until the host resumes the bus.
+extern volatile bool usb_suspended;
+
+// Set by the host with SET_FEATURE(DEVICE_REMOTE_WAKEUP).
+extern volatile bool usb_remote_wakeup_enabled;
+
+// Signals resume to a suspended host. Returns -1 when the bus isn't
+// suspended or the host hasn't allowed remote wakeup.
+int usb_remote_wakeup();
+// HID protocol the host selected for each keyboard, 0 = boot, 1 = report.
+extern volatile uint8_t keyboard_protocols[USB_MAX_KEYBOARDS];
+
+// Sends a report on the given keyboard (0 = the first keyboard interface)
+// if it differs from the last one. Returns -1 without waiting when both of
+// the keyboard's banks are still full, so try again with the next report.
+int usb_send(uint8_t keyboard, const uint8_t* report, uint8_t length);
+
+// Same for the joystick interface. Returns -1 straight away when the
+// configuration doesn't have one.
+int usb_send_joystick(const uint8_t* report, uint8_t length);
+
+// The 11-bit number of the current USB frame, from the last SOF.
+uint16_t usb_frame_number();
+
+// clock_ticks() when the last SOF arrived.
+uint16_t usb_frame_start();
+
+// Non-blocking access to the vendor interface. Both return -1 (send) or 0
+// (receive) straight away when the endpoint isn't ready, so the main loop
+// never waits on the host for config or telemetry traffic. Payloads are up
+// to VENDOR_DATA_SIZE bytes, the report ID is added and stripped here.
+int usb_send_telemetry(const uint8_t* data, uint8_t length);
+int usb_receive_config(uint8_t* data, uint8_t length);